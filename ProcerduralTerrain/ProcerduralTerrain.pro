@@ -4,17 +4,40 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
+QT       += core gui concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = ProcerduralTerrain
 TEMPLATE = app
+CONFIG += c++11
 
 
 SOURCES += main.cpp\
-        terrainwindow.cpp
+        terrainwindow.cpp \
+        collisionworld.cpp \
+        terrainscatter.cpp \
+        taskscheduler.cpp \
+        heightfield.cpp \
+        terrainkernels.cpp \
+        terrainbenchmark.cpp \
+        buildarena.cpp \
+        terrainlighting.cpp \
+        collisionbenchmark.cpp \
+        heightfieldcheck.cpp \
+        kernelbenchmark.cpp
 
-HEADERS  += terrainwindow.h
+HEADERS  += terrainwindow.h \
+        collisionworld.h \
+        terrainscatter.h \
+        taskscheduler.h \
+        heightfield.h \
+        terrainkernels.h \
+        terrainbenchmark.h \
+        buildarena.h \
+        terrainlighting.h \
+        collisionbenchmark.h \
+        heightfieldcheck.h \
+        kernelbenchmark.h
 
 FORMS    += terrainwindow.ui
@@ -0,0 +1,81 @@
+/****************************************************************************
+**
+Monotonic arena for the scratch memory of one terrain build.
+**
+****************************************************************************/
+
+#include "buildarena.h"
+
+#include <stdint.h>
+
+BuildArena::BuildArena()
+{
+    current = NULL;
+    currentSize = 0;
+    used = 0;
+    allocations = 0;
+    bytes = 0;
+}
+
+BuildArena::~BuildArena()
+{
+    release();
+}
+
+void *BuildArena::allocate(size_t size, size_t alignment) {
+    std::lock_guard<std::mutex> guard(lock);
+    allocations++;
+    bytes += size;
+
+    // Large requests get a chunk of their own, which leaves the current chunk to the small ones
+    if (size > ARENA_MAX_WASTE) {
+        Chunk chunk;
+        chunk.size = size + alignment;
+        chunk.memory = (char *) ::operator new(chunk.size);
+        chunks.push_back(chunk);
+        return (void *) (((uintptr_t) chunk.memory + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    }
+
+    uintptr_t start = ((uintptr_t) current + used + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    if (current == NULL || start + size > (uintptr_t) current + currentSize) {
+        Chunk chunk;
+        chunk.size = ARENA_CHUNK_SIZE;
+        chunk.memory = (char *) ::operator new(chunk.size);
+        chunks.push_back(chunk);
+        current = chunk.memory;
+        currentSize = chunk.size;
+        start = ((uintptr_t) current + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    }
+    used = start + size - (uintptr_t) current;
+    return (void *) start;
+}
+
+/* One free per chunk, however many allocations were made */
+void BuildArena::release() {
+    unsigned int i;
+    std::lock_guard<std::mutex> guard(lock);
+    for (i = 0; i < chunks.size(); i++) {
+        ::operator delete(chunks[i].memory);
+    }
+    std::vector<Chunk>().swap(chunks);
+    current = NULL;
+    currentSize = 0;
+    used = 0;
+    allocations = 0;
+    bytes = 0;
+}
+
+size_t BuildArena::allocationCount() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return allocations;
+}
+
+size_t BuildArena::bytesAllocated() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return bytes;
+}
+
+size_t BuildArena::chunkCount() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return chunks.size();
+}
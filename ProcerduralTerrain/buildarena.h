@@ -0,0 +1,71 @@
+/****************************************************************************
+**
+Monotonic arena for the scratch memory of one terrain build.
+Allocations are carved out of large chunks and are never freed one by one,
+release() hands all chunks back at once. Safe to allocate from several
+threads. No destructors are run, so only plain data such as floats,
+QVector3D or pointers should live in it.
+**
+****************************************************************************/
+
+#ifndef BUILDARENA_H
+#define BUILDARENA_H
+
+#include <QtGlobal>
+#include <mutex>
+#include <new>
+#include <vector>
+
+class BuildArena
+{
+public:
+    BuildArena();
+    ~BuildArena();
+
+    void *allocate(size_t bytes, size_t alignment);
+    /* Frees every allocation made since the last release */
+    void release();
+
+    /* count default constructed values of T */
+    template<class T> T *allocateArray(size_t count) {
+        T *values = (T *) allocate(count * sizeof(T), Q_ALIGNOF(T));
+        for (size_t i = 0; i < count; i++) {
+            new (&values[i]) T();
+        }
+        return values;
+    }
+
+    /* rows x columns values of T in one block, plus the row pointers into it */
+    template<class T> T **allocateRows(size_t rows, size_t columns) {
+        T **rowPointers = (T **) allocate(rows * sizeof(T *), Q_ALIGNOF(T *));
+        T *values = allocateArray<T>(rows * columns);
+        for (size_t i = 0; i < rows; i++) {
+            rowPointers[i] = values + i * columns;
+        }
+        return rowPointers;
+    }
+
+    /* Since the last release */
+    size_t allocationCount() const;
+    size_t bytesAllocated() const;
+    size_t chunkCount() const;
+
+private:
+    struct Chunk {
+        char *memory;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    char *current;        // chunk that small allocations are taken from
+    size_t currentSize;
+    size_t used;          // bytes taken from current
+    size_t allocations;
+    size_t bytes;
+    mutable std::mutex lock;
+
+#define ARENA_CHUNK_SIZE (4 << 20)
+#define ARENA_MAX_WASTE (64 << 10)  // larger requests get a chunk of their own
+};
+
+#endif // BUILDARENA_H
@@ -0,0 +1,140 @@
+/****************************************************************************
+**
+Collision world benchmark.
+**
+****************************************************************************/
+
+#include "collisionbenchmark.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+
+/* Entry fraction of the segment origin + t * dir, t in [0, 1], into a box, -1 if it misses. Written
+ * apart from the tree's own test so the two can be compared. */
+static float bruteSegmentBox(const QVector3D &origin, const QVector3D &dir, const QVector3D &lo, const QVector3D &hi) {
+    float tMin = 0.0f;
+    float tMax = 1.0f;
+    for (int a = 0; a < 3; a++) {
+        if (dir[a] == 0.0f) {
+            if (origin[a] < lo[a] || origin[a] > hi[a])
+                return -1.0f;
+            continue;
+        }
+        float t1 = (lo[a] - origin[a]) / dir[a];
+        float t2 = (hi[a] - origin[a]) / dir[a];
+        tMin = std::max(tMin, std::min(t1, t2));
+        tMax = std::min(tMax, std::max(t1, t2));
+    }
+    return tMin <= tMax ? tMin : -1.0f;
+}
+
+CollisionBenchmark::CollisionBenchmark(unsigned int seed)
+{
+    rng.seed(seed);
+    worldSize = 2.0f;
+}
+
+float CollisionBenchmark::random(float lo, float hi) {
+    return lo + (hi - lo) * (rng() - rng.min()) / (float) (rng.max() - rng.min());
+}
+
+void CollisionBenchmark::randomBox(float size, QVector3D *minPoint, QVector3D *maxPoint) {
+    float half = 0.5f * worldSize;
+    *minPoint = QVector3D(random(-half, half), random(-half, half), random(-half, half));
+    *maxPoint = *minPoint + QVector3D(random(0.0f, size), random(0.0f, size), random(0.0f, size));
+}
+
+bool CollisionBenchmark::run(int maxBoxes) {
+    bool matched = true;
+    int boxes;
+    for (boxes = 1000; boxes < maxBoxes; boxes *= 10) {
+        matched &= runWorld(boxes);
+    }
+    matched &= runWorld(maxBoxes);
+    qDebug() << "Collision benchmark:" << (matched ? "all checked queries match" : "QUERY MISMATCH");
+    return matched;
+}
+
+/* The nodes a tree query visits grow with log(boxes), a scan grows with boxes. Once the tree outgrows
+ * the caches, around 100000 boxes, query times grow faster than the visits as more of them miss. */
+bool CollisionBenchmark::runWorld(int boxes) {
+    worldSize = 2.0f * cbrtf(boxes / (float) BENCHMARK_DENSITY_BOXES);
+    CollisionWorld world;
+    QElapsedTimer timer;
+    QVector3D lo, hi;
+    std::vector<int> hits;
+    int b, q, mismatches = 0;
+    qint64 found = 0;
+
+    timer.start();
+    for (b = 0; b < boxes; b++) {
+        randomBox(BENCHMARK_BOX_SIZE, &lo, &hi);
+        world.addBox(lo, hi);
+    }
+    double insertNs = timer.nsecsElapsed() / (double) boxes;
+
+    // Most moves stay inside the fattened leaf, some leave it and are reinserted
+    timer.restart();
+    for (b = 0; b < boxes; b++) {
+        QVector3D step(random(-2.0f, 2.0f), random(-2.0f, 2.0f), random(-2.0f, 2.0f));
+        step *= COLLISION_MARGIN;
+        world.moveBox(b, world.boxMin(b) + step, world.boxMax(b) + step);
+    }
+    double moveNs = timer.nsecsElapsed() / (double) boxes;
+
+    std::vector<QVector3D> queryLo(BENCHMARK_QUERIES), queryHi(BENCHMARK_QUERIES);
+    std::vector<QVector3D> from(BENCHMARK_QUERIES), to(BENCHMARK_QUERIES);
+    for (q = 0; q < BENCHMARK_QUERIES; q++) {
+        randomBox(BENCHMARK_QUERY_SIZE, &queryLo[q], &queryHi[q]);
+        randomBox(BENCHMARK_QUERY_SIZE, &from[q], &to[q]);
+    }
+
+    timer.restart();
+    for (q = 0; q < BENCHMARK_QUERIES; q++) {
+        hits.clear();
+        world.queryBox(queryLo[q], queryHi[q], hits);
+        found += hits.size();
+    }
+    double boxQueryNs = timer.nsecsElapsed() / (double) BENCHMARK_QUERIES;
+
+    std::vector<float> segmentT(BENCHMARK_QUERIES);
+    std::vector<int> segmentHit(BENCHMARK_QUERIES);
+    timer.restart();
+    for (q = 0; q < BENCHMARK_QUERIES; q++) {
+        segmentHit[q] = world.querySegment(from[q], to[q], &segmentT[q]);
+    }
+    double segmentQueryNs = timer.nsecsElapsed() / (double) BENCHMARK_QUERIES;
+
+    // Brute force over every box for the first queries. Segments are compared by the nearest hit
+    // fraction, as two boxes may be entered at the same point.
+    timer.restart();
+    for (q = 0; q < BENCHMARK_CHECKED_QUERIES; q++) {
+        std::vector<int> expected;
+        float nearest = -1.0f;
+        for (b = 0; b < boxes; b++) {
+            QVector3D bLo = world.boxMin(b), bHi = world.boxMax(b);
+            if (bLo.x() <= queryHi[q].x() && bHi.x() >= queryLo[q].x() && bLo.y() <= queryHi[q].y()
+                    && bHi.y() >= queryLo[q].y() && bLo.z() <= queryHi[q].z() && bHi.z() >= queryLo[q].z())
+                expected.push_back(b);
+            float t = bruteSegmentBox(from[q], to[q] - from[q], bLo, bHi);
+            if (t >= 0.0f && (nearest < 0.0f || t < nearest))
+                nearest = t;
+        }
+        hits.clear();
+        world.queryBox(queryLo[q], queryHi[q], hits);
+        std::sort(hits.begin(), hits.end());
+        if (hits != expected)
+            mismatches++;
+        if ((nearest < 0.0f) != (segmentHit[q] == -1)
+                || (nearest >= 0.0f && fabs(nearest - segmentT[q]) > 1e-4f))
+            mismatches++;
+    }
+    double scanNs = timer.nsecsElapsed() / (2.0 * BENCHMARK_CHECKED_QUERIES);
+
+    qDebug() << "  " << boxes << "boxes: insert" << insertNs << "ns, move" << moveNs << "ns, box query"
+             << boxQueryNs << "ns (" << found / (double) BENCHMARK_QUERIES << "hits ), segment query"
+             << segmentQueryNs << "ns, brute force scan" << scanNs << "ns," << mismatches << "mismatches";
+    return mismatches == 0;
+}
@@ -0,0 +1,47 @@
+/****************************************************************************
+**
+Collision world benchmark.
+Fills CollisionWorlds of growing size with random boxes, moves every box and
+runs box and segment queries, timing each operation and checking a sample of
+the query results against a brute force scan. Needs no OpenGL:
+    ./ProcerduralTerrain --collision-benchmark=100000
+**
+****************************************************************************/
+
+#ifndef COLLISIONBENCHMARK_H
+#define COLLISIONBENCHMARK_H
+
+#include <QVector3D>
+#include <random>
+#include <vector>
+
+#include "collisionworld.h"
+
+class CollisionBenchmark
+{
+public:
+    explicit CollisionBenchmark(unsigned int seed = 1);
+
+    /* Runs worlds of 1000, 10000, ... boxes up to maxBoxes, false if any checked query differed
+     * from the brute force result */
+    bool run(int maxBoxes);
+
+private:
+    bool runWorld(int boxes);
+    void randomBox(float size, QVector3D *minPoint, QVector3D *maxPoint);
+    float random(float lo, float hi);
+
+    std::minstd_rand rng;
+    float worldSize;
+
+/* Boxes have sides up to BENCHMARK_BOX_SIZE, query boxes and segments up to BENCHMARK_QUERY_SIZE.
+ * The world grows with the box count so boxes keep the density of BENCHMARK_DENSITY_BOXES in a
+ * cube of side 2, and queries hit about as many boxes whatever the world size. */
+#define BENCHMARK_DENSITY_BOXES 100000
+#define BENCHMARK_BOX_SIZE 0.05f
+#define BENCHMARK_QUERY_SIZE 0.1f
+#define BENCHMARK_QUERIES 10000
+#define BENCHMARK_CHECKED_QUERIES 500
+};
+
+#endif // COLLISIONBENCHMARK_H
@@ -0,0 +1,514 @@
+/****************************************************************************
+**
+Collision detection for the terrain window.
+**
+****************************************************************************/
+
+#include "collisionworld.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+/* Slab test of the segment origin + t * dir, t in [0, maxT], against a box. Returns the entry fraction or -1 */
+static float segmentBox(const float origin[3], const float dir[3], float maxT, const float lo[3], const float hi[3]) {
+    float tMin = 0.0f;
+    float tMax = maxT;
+    for (int a = 0; a < 3; a++) {
+        if (fabs(dir[a]) < 1e-12f) {
+            if (origin[a] < lo[a] || origin[a] > hi[a])
+                return -1.0f;
+        } else {
+            float inv = 1.0f / dir[a];
+            float t1 = (lo[a] - origin[a]) * inv;
+            float t2 = (hi[a] - origin[a]) * inv;
+            if (t1 > t2)
+                std::swap(t1, t2);
+            tMin = std::max(tMin, t1);
+            tMax = std::min(tMax, t2);
+            if (tMin > tMax)
+                return -1.0f;
+        }
+    }
+    return tMin;
+}
+
+/* Queries walk the tree with a fixed stack of COLLISION_STACK_SIZE nodes. A tree deeper than that is
+ * not expected as balance keeps the height logarithmic, but should one come about the stack moves to the
+ * heap, doubling whenever it is full. */
+static int *growStack(int *stack, std::vector<int> &heapStack, int top, int *capacity) {
+    if (heapStack.empty())
+        heapStack.assign(stack, stack + top);
+    heapStack.resize(2 * *capacity);
+    *capacity = (int) heapStack.size();
+    return heapStack.data();
+}
+
+CollisionWorld::CollisionWorld()
+{
+    liveBoxes = 0;
+    root = -1;
+    freeNodes = -1;
+    heights = NULL;
+    normals = NULL;
+    meshSize = 0;
+    minCoord = -1.0f;
+    maxCoord = 1.0f;
+}
+
+void CollisionWorld::swap(CollisionWorld &other) {
+    minX.swap(other.minX);
+    minY.swap(other.minY);
+    minZ.swap(other.minZ);
+    maxX.swap(other.maxX);
+    maxY.swap(other.maxY);
+    maxZ.swap(other.maxZ);
+    boxLeaf.swap(other.boxLeaf);
+    freeBoxes.swap(other.freeBoxes);
+    std::swap(liveBoxes, other.liveBoxes);
+    nodes.swap(other.nodes);
+    std::swap(root, other.root);
+    std::swap(freeNodes, other.freeNodes);
+    std::swap(heights, other.heights);
+    std::swap(normals, other.normals);
+    std::swap(meshSize, other.meshSize);
+    std::swap(minCoord, other.minCoord);
+    std::swap(maxCoord, other.maxCoord);
+}
+
+int CollisionWorld::addBox(const QVector3D &minPoint, const QVector3D &maxPoint) {
+    int box;
+    if (!freeBoxes.empty()) {
+        box = freeBoxes.back();
+        freeBoxes.pop_back();
+    } else {
+        box = (int) boxLeaf.size();
+        minX.push_back(0.0f); minY.push_back(0.0f); minZ.push_back(0.0f);
+        maxX.push_back(0.0f); maxY.push_back(0.0f); maxZ.push_back(0.0f);
+        boxLeaf.push_back(-1);
+    }
+    minX[box] = minPoint.x(); minY[box] = minPoint.y(); minZ[box] = minPoint.z();
+    maxX[box] = maxPoint.x(); maxY[box] = maxPoint.y(); maxZ[box] = maxPoint.z();
+
+    int leaf = allocateNode();
+    nodes[leaf].box = box;
+    nodes[leaf].height = 0;
+    setLeafBounds(leaf, box);
+    insertLeaf(leaf);
+    boxLeaf[box] = leaf;
+    liveBoxes++;
+    return box;
+}
+
+/* Only touches the tree when the box has left the fattened bounds of its leaf */
+void CollisionWorld::moveBox(int box, const QVector3D &minPoint, const QVector3D &maxPoint) {
+    int leaf = boxLeaf[box];
+    minX[box] = minPoint.x(); minY[box] = minPoint.y(); minZ[box] = minPoint.z();
+    maxX[box] = maxPoint.x(); maxY[box] = maxPoint.y(); maxZ[box] = maxPoint.z();
+
+    const Node &n = nodes[leaf];
+    if (n.lo[0] <= minX[box] && n.lo[1] <= minY[box] && n.lo[2] <= minZ[box]
+            && n.hi[0] >= maxX[box] && n.hi[1] >= maxY[box] && n.hi[2] >= maxZ[box])
+        return;
+
+    removeLeaf(leaf);
+    setLeafBounds(leaf, box);
+    insertLeaf(leaf);
+}
+
+void CollisionWorld::removeBox(int box) {
+    int leaf = boxLeaf[box];
+    removeLeaf(leaf);
+    freeNode(leaf);
+    boxLeaf[box] = -1;
+    freeBoxes.push_back(box);
+    liveBoxes--;
+}
+
+int CollisionWorld::boxCount() const {
+    return liveBoxes;
+}
+
+QVector3D CollisionWorld::boxMin(int box) const {
+    return QVector3D(minX[box], minY[box], minZ[box]);
+}
+
+QVector3D CollisionWorld::boxMax(int box) const {
+    return QVector3D(maxX[box], maxY[box], maxZ[box]);
+}
+
+void CollisionWorld::queryPoint(const QVector3D &point, std::vector<int> &hits) const {
+    queryBox(point, point, hits);
+}
+
+void CollisionWorld::queryBox(const QVector3D &minPoint, const QVector3D &maxPoint, std::vector<int> &hits) const {
+    int fixedStack[COLLISION_STACK_SIZE];
+    int *stack = fixedStack;
+    int capacity = COLLISION_STACK_SIZE;
+    std::vector<int> heapStack;
+    int top = 0;
+    float lo[3] = { minPoint.x(), minPoint.y(), minPoint.z() };
+    float hi[3] = { maxPoint.x(), maxPoint.y(), maxPoint.z() };
+
+    if (root != -1)
+        stack[top++] = root;
+    while (top > 0) {
+        const Node &n = nodes[stack[--top]];
+        if (n.lo[0] > hi[0] || n.hi[0] < lo[0] || n.lo[1] > hi[1] || n.hi[1] < lo[1]
+                || n.lo[2] > hi[2] || n.hi[2] < lo[2])
+            continue;
+        if (n.box != -1) {
+            int b = n.box;
+            if (minX[b] <= hi[0] && maxX[b] >= lo[0] && minY[b] <= hi[1] && maxY[b] >= lo[1]
+                    && minZ[b] <= hi[2] && maxZ[b] >= lo[2])
+                hits.push_back(b);
+        } else {
+            if (top + 2 > capacity)
+                stack = growStack(stack, heapStack, top, &capacity);
+            stack[top++] = n.child1;
+            stack[top++] = n.child2;
+        }
+    }
+}
+
+int CollisionWorld::querySegment(const QVector3D &from, const QVector3D &to, float *t) const {
+    int fixedStack[COLLISION_STACK_SIZE];
+    int *stack = fixedStack;
+    int capacity = COLLISION_STACK_SIZE;
+    std::vector<int> heapStack;
+    int top = 0;
+    int nearest = -1;
+    float origin[3] = { from.x(), from.y(), from.z() };
+    float dir[3] = { to.x() - from.x(), to.y() - from.y(), to.z() - from.z() };
+    float maxT = 1.0f;
+
+    if (root != -1)
+        stack[top++] = root;
+    while (top > 0) {
+        const Node &n = nodes[stack[--top]];
+        // maxT shrinks with every hit, so subtrees behind the nearest hit are culled here
+        if (segmentBox(origin, dir, maxT, n.lo, n.hi) < 0.0f)
+            continue;
+        if (n.box != -1) {
+            int b = n.box;
+            float lo[3] = { minX[b], minY[b], minZ[b] };
+            float hi[3] = { maxX[b], maxY[b], maxZ[b] };
+            float hitT = segmentBox(origin, dir, maxT, lo, hi);
+            if (hitT >= 0.0f) {
+                maxT = hitT;
+                nearest = b;
+            }
+        } else {
+            if (top + 2 > capacity)
+                stack = growStack(stack, heapStack, top, &capacity);
+            stack[top++] = n.child1;
+            stack[top++] = n.child2;
+        }
+    }
+    if (t != NULL && nearest != -1)
+        *t = maxT;
+    return nearest;
+}
+
+void CollisionWorld::setTerrain(const Heightfield *heights, const PackedNormals *normals, float minCoord, float maxCoord) {
+    this->heights = heights;
+    this->normals = normals;
+    this->meshSize = heights->size();
+    this->minCoord = minCoord;
+    this->maxCoord = maxCoord;
+}
+
+/* Height of the rendered surface at (x, z), following the same diagonal split as addHeightMap.
+ * Points off the map are clamped to its edge. */
+float CollisionWorld::terrainHeight(float x, float z) const {
+    float scaleFactor = (maxCoord - minCoord) / (float) meshSize;
+    float fx = std::max(0.0f, std::min((x - minCoord) / scaleFactor, (float) (meshSize - 1)));
+    float fz = std::max(0.0f, std::min((z - minCoord) / scaleFactor, (float) (meshSize - 1)));
+    unsigned int i = std::min((unsigned int) fx, meshSize - 2);
+    unsigned int j = std::min((unsigned int) fz, meshSize - 2);
+    float tx = fx - i;
+    float tz = fz - j;
+    float h00 = heights->height(i, j);
+    float h10 = heights->height(i+1, j);
+    float h01 = heights->height(i, j+1);
+    float h11 = heights->height(i+1, j+1);
+
+    if (tx + tz <= 1.0f) {
+        return h00 + tx * (h10 - h00) + tz * (h01 - h00);
+    }
+    return h11 + (1.0f - tx) * (h01 - h11) + (1.0f - tz) * (h10 - h11);
+}
+
+/* Cell (i, j) holds triangle 2j below the diagonal terrainHeight splits at and 2j + 1 above it */
+QVector3D CollisionWorld::terrainNormal(float x, float z) const {
+    float scaleFactor = (maxCoord - minCoord) / (float) meshSize;
+    float fx = std::max(0.0f, std::min((x - minCoord) / scaleFactor, (float) (meshSize - 1)));
+    float fz = std::max(0.0f, std::min((z - minCoord) / scaleFactor, (float) (meshSize - 1)));
+    unsigned int i = std::min((unsigned int) fx, meshSize - 2);
+    unsigned int j = std::min((unsigned int) fz, meshSize - 2);
+    return normals->normal(i, (fx - i) + (fz - j) <= 1.0f ? 2 * j : 2 * j + 1);
+}
+
+bool CollisionWorld::terrainContains(const QVector3D &point) const {
+    return point.y() <= terrainHeight(point.x(), point.z());
+}
+
+/* Conservative: compares against the highest vertex of every cell the box covers */
+bool CollisionWorld::terrainIntersectsBox(const QVector3D &minPoint, const QVector3D &maxPoint) const {
+    float scaleFactor = (maxCoord - minCoord) / (float) meshSize;
+    float extent = minCoord + (meshSize - 1) * scaleFactor;
+    if (maxPoint.x() < minCoord || minPoint.x() > extent || maxPoint.z() < minCoord || minPoint.z() > extent)
+        return false;
+
+    unsigned int i0 = (unsigned int) std::max(0.0f, (float) floor((minPoint.x() - minCoord) / scaleFactor));
+    unsigned int j0 = (unsigned int) std::max(0.0f, (float) floor((minPoint.z() - minCoord) / scaleFactor));
+    unsigned int i1 = std::min((unsigned int) ceil((maxPoint.x() - minCoord) / scaleFactor), meshSize - 1);
+    unsigned int j1 = std::min((unsigned int) ceil((maxPoint.z() - minCoord) / scaleFactor), meshSize - 1);
+    for (unsigned int i = i0; i <= i1; i++) {
+        for (unsigned int j = j0; j <= j1; j++) {
+            if (minPoint.y() <= heights->height(i, j))
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Marches the segment in half-cell steps, then bisects the step where it first goes below the surface */
+bool CollisionWorld::terrainSegment(const QVector3D &from, const QVector3D &to, float *t) const {
+    int i, steps;
+    float scaleFactor = (maxCoord - minCoord) / (float) meshSize;
+    QVector3D dir = to - from;
+    float horizontal = sqrt(dir.x() * dir.x() + dir.z() * dir.z());
+    float prevT = 0.0f;
+
+    if (terrainContains(from)) {
+        if (t != NULL)
+            *t = 0.0f;
+        return true;
+    }
+
+    steps = 1 + (int) ceil(horizontal / (0.5f * scaleFactor));
+    for (i = 1; i <= steps; i++) {
+        float curT = (float) i / steps;
+        if (terrainContains(from + dir * curT)) {
+            float lo = prevT, hi = curT;
+            for (int k = 0; k < 16; k++) {
+                float mid = 0.5f * (lo + hi);
+                if (terrainContains(from + dir * mid))
+                    hi = mid;
+                else
+                    lo = mid;
+            }
+            if (t != NULL)
+                *t = hi;
+            return true;
+        }
+        prevT = curT;
+    }
+    return false;
+}
+
+int CollisionWorld::allocateNode() {
+    int node;
+    if (freeNodes != -1) {
+        node = freeNodes;
+        freeNodes = nodes[node].parent;
+    } else {
+        node = (int) nodes.size();
+        nodes.push_back(Node());
+    }
+    nodes[node].parent = -1;
+    nodes[node].child1 = -1;
+    nodes[node].child2 = -1;
+    nodes[node].box = -1;
+    nodes[node].height = 0;
+    return node;
+}
+
+void CollisionWorld::freeNode(int node) {
+    nodes[node].parent = freeNodes;
+    nodes[node].height = -1;
+    freeNodes = node;
+}
+
+void CollisionWorld::setLeafBounds(int leaf, int box) {
+    Node &n = nodes[leaf];
+    n.lo[0] = minX[box] - COLLISION_MARGIN;
+    n.lo[1] = minY[box] - COLLISION_MARGIN;
+    n.lo[2] = minZ[box] - COLLISION_MARGIN;
+    n.hi[0] = maxX[box] + COLLISION_MARGIN;
+    n.hi[1] = maxY[box] + COLLISION_MARGIN;
+    n.hi[2] = maxZ[box] + COLLISION_MARGIN;
+}
+
+static float surfaceArea(const float lo[3], const float hi[3]) {
+    float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static void combine(const float aLo[3], const float aHi[3], const float bLo[3], const float bHi[3], float lo[3], float hi[3]) {
+    for (int a = 0; a < 3; a++) {
+        lo[a] = std::min(aLo[a], bLo[a]);
+        hi[a] = std::max(aHi[a], bHi[a]);
+    }
+}
+
+/* Descends towards the sibling with the cheapest surface area increase, then rebalances on the way up */
+void CollisionWorld::insertLeaf(int leaf) {
+    float lo[3], hi[3];
+
+    if (root == -1) {
+        root = leaf;
+        nodes[root].parent = -1;
+        return;
+    }
+
+    int index = root;
+    while (nodes[index].box == -1) {
+        const Node &n = nodes[index];
+        const Node &c1 = nodes[n.child1];
+        const Node &c2 = nodes[n.child2];
+        const Node &l = nodes[leaf];
+
+        float area = surfaceArea(n.lo, n.hi);
+        combine(n.lo, n.hi, l.lo, l.hi, lo, hi);
+        float combinedArea = surfaceArea(lo, hi);
+        float cost = 2.0f * combinedArea;
+        float inheritance = 2.0f * (combinedArea - area);
+
+        combine(c1.lo, c1.hi, l.lo, l.hi, lo, hi);
+        float cost1 = surfaceArea(lo, hi) + inheritance;
+        if (c1.box == -1)
+            cost1 -= surfaceArea(c1.lo, c1.hi);
+
+        combine(c2.lo, c2.hi, l.lo, l.hi, lo, hi);
+        float cost2 = surfaceArea(lo, hi) + inheritance;
+        if (c2.box == -1)
+            cost2 -= surfaceArea(c2.lo, c2.hi);
+
+        if (cost < cost1 && cost < cost2)
+            break;
+        index = cost1 < cost2 ? n.child1 : n.child2;
+    }
+
+    int sibling = index;
+    int oldParent = nodes[sibling].parent;
+    int newParent = allocateNode();
+    nodes[newParent].parent = oldParent;
+    combine(nodes[leaf].lo, nodes[leaf].hi, nodes[sibling].lo, nodes[sibling].hi, nodes[newParent].lo, nodes[newParent].hi);
+    nodes[newParent].height = nodes[sibling].height + 1;
+    nodes[newParent].child1 = sibling;
+    nodes[newParent].child2 = leaf;
+    nodes[sibling].parent = newParent;
+    nodes[leaf].parent = newParent;
+
+    if (oldParent != -1) {
+        if (nodes[oldParent].child1 == sibling)
+            nodes[oldParent].child1 = newParent;
+        else
+            nodes[oldParent].child2 = newParent;
+    } else {
+        root = newParent;
+    }
+
+    index = nodes[leaf].parent;
+    while (index != -1) {
+        index = balance(index);
+        Node &n = nodes[index];
+        n.height = 1 + std::max(nodes[n.child1].height, nodes[n.child2].height);
+        combine(nodes[n.child1].lo, nodes[n.child1].hi, nodes[n.child2].lo, nodes[n.child2].hi, n.lo, n.hi);
+        index = n.parent;
+    }
+}
+
+void CollisionWorld::removeLeaf(int leaf) {
+    if (leaf == root) {
+        root = -1;
+        return;
+    }
+
+    int parent = nodes[leaf].parent;
+    int grandParent = nodes[parent].parent;
+    int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+    if (grandParent == -1) {
+        root = sibling;
+        nodes[sibling].parent = -1;
+        freeNode(parent);
+        return;
+    }
+
+    if (nodes[grandParent].child1 == parent)
+        nodes[grandParent].child1 = sibling;
+    else
+        nodes[grandParent].child2 = sibling;
+    nodes[sibling].parent = grandParent;
+    freeNode(parent);
+
+    int index = grandParent;
+    while (index != -1) {
+        index = balance(index);
+        Node &n = nodes[index];
+        n.height = 1 + std::max(nodes[n.child1].height, nodes[n.child2].height);
+        combine(nodes[n.child1].lo, nodes[n.child1].hi, nodes[n.child2].lo, nodes[n.child2].hi, n.lo, n.hi);
+        index = n.parent;
+    }
+}
+
+/* AVL style rotation of node a when its children differ in height by more than COLLISION_MAX_IMBALANCE.
+ * The slack keeps the height logarithmic without undoing too much of the surface area heuristic.
+ * Returns the node now at a's position in the tree. */
+int CollisionWorld::balance(int a) {
+    if (nodes[a].box != -1 || nodes[a].height < 2)
+        return a;
+
+    int b = nodes[a].child1;
+    int c = nodes[a].child2;
+    int heightDiff = nodes[c].height - nodes[b].height;
+
+    if (heightDiff > COLLISION_MAX_IMBALANCE || heightDiff < -COLLISION_MAX_IMBALANCE) {
+        // Rotate the taller child up
+        int up = heightDiff > 0 ? c : b;
+        int other = heightDiff > 0 ? b : c;
+        int f = nodes[up].child1;
+        int g = nodes[up].child2;
+
+        nodes[up].child1 = a;
+        nodes[up].parent = nodes[a].parent;
+        nodes[a].parent = up;
+
+        if (nodes[up].parent != -1) {
+            if (nodes[nodes[up].parent].child1 == a)
+                nodes[nodes[up].parent].child1 = up;
+            else
+                nodes[nodes[up].parent].child2 = up;
+        } else {
+            root = up;
+        }
+
+        // The taller grandchild stays under up and the shorter one moves under a.
+        // When they are level, move whichever gives a the smaller bounds.
+        int keep = nodes[f].height > nodes[g].height ? f : g;
+        if (nodes[f].height == nodes[g].height) {
+            float lo[3], hi[3];
+            combine(nodes[other].lo, nodes[other].hi, nodes[f].lo, nodes[f].hi, lo, hi);
+            float areaF = surfaceArea(lo, hi);
+            combine(nodes[other].lo, nodes[other].hi, nodes[g].lo, nodes[g].hi, lo, hi);
+            keep = areaF < surfaceArea(lo, hi) ? g : f;
+        }
+        int move = keep == f ? g : f;
+        nodes[up].child2 = keep;
+        if (heightDiff > 0)
+            nodes[a].child2 = move;
+        else
+            nodes[a].child1 = move;
+        nodes[move].parent = a;
+
+        combine(nodes[other].lo, nodes[other].hi, nodes[move].lo, nodes[move].hi, nodes[a].lo, nodes[a].hi);
+        combine(nodes[a].lo, nodes[a].hi, nodes[keep].lo, nodes[keep].hi, nodes[up].lo, nodes[up].hi);
+        nodes[a].height = 1 + std::max(nodes[other].height, nodes[move].height);
+        nodes[up].height = 1 + std::max(nodes[a].height, nodes[keep].height);
+        return up;
+    }
+    return a;
+}
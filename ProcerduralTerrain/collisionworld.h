@@ -0,0 +1,88 @@
+/****************************************************************************
+**
+Collision detection for the terrain window.
+Axis aligned boxes are kept in structure-of-arrays form and indexed by a
+dynamic bounding volume hierarchy, the terrain is queried directly from the
+height map.
+**
+****************************************************************************/
+
+#ifndef COLLISIONWORLD_H
+#define COLLISIONWORLD_H
+
+#include <QVector3D>
+#include <vector>
+
+#include "heightfield.h"
+
+class CollisionWorld
+{
+public:
+    CollisionWorld();
+
+    /* Exchanges boxes and terrain with other, so a world can be built on another thread and
+     * handed over in constant time */
+    void swap(CollisionWorld &other);
+
+    /* Boxes are referred to by the id returned from addBox. Ids of removed boxes are reused. */
+    int addBox(const QVector3D &minPoint, const QVector3D &maxPoint);
+    void moveBox(int box, const QVector3D &minPoint, const QVector3D &maxPoint);
+    void removeBox(int box);
+    int boxCount() const;
+    QVector3D boxMin(int box) const;
+    QVector3D boxMax(int box) const;
+
+    /* Object queries, the ids of every box hit are appended to hits */
+    void queryPoint(const QVector3D &point, std::vector<int> &hits) const;
+    void queryBox(const QVector3D &minPoint, const QVector3D &maxPoint, std::vector<int> &hits) const;
+    /* Returns the nearest box hit by the segment from -> to (or -1), t is the hit fraction along the segment */
+    int querySegment(const QVector3D &from, const QVector3D &to, float *t) const;
+
+    /* Terrain queries. The terrain is treated as solid below the height map surface. normals holds
+     * the face normals of the two triangles of every cell. */
+    void setTerrain(const Heightfield *heights, const PackedNormals *normals, float minCoord, float maxCoord);
+    float terrainHeight(float x, float z) const;
+    /* Face normal of the triangle of the rendered surface at (x, z) */
+    QVector3D terrainNormal(float x, float z) const;
+    bool terrainContains(const QVector3D &point) const;
+    bool terrainIntersectsBox(const QVector3D &minPoint, const QVector3D &maxPoint) const;
+    bool terrainSegment(const QVector3D &from, const QVector3D &to, float *t) const;
+
+private:
+    struct Node {
+        float lo[3], hi[3];  // fattened bounds of the subtree
+        int parent;          // next free node while on the free list
+        int child1, child2;
+        int box;             // -1 for internal nodes
+        int height;          // -1 for free nodes
+    };
+
+    int allocateNode();
+    void freeNode(int node);
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+    int balance(int node);
+    void setLeafBounds(int leaf, int box);
+
+    /* Tight box bounds, one array per axis so queries only touch what they need */
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+    std::vector<int> boxLeaf;    // tree leaf of each box, -1 if the id is free
+    std::vector<int> freeBoxes;
+    int liveBoxes;
+
+    std::vector<Node> nodes;
+    int root;
+    int freeNodes;
+
+    const Heightfield *heights;
+    const PackedNormals *normals;
+    unsigned int meshSize;
+    float minCoord, maxCoord;
+
+#define COLLISION_MARGIN 0.01f
+#define COLLISION_STACK_SIZE 128
+#define COLLISION_MAX_IMBALANCE 3
+};
+
+#endif // COLLISIONWORLD_H
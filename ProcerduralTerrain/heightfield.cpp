@@ -0,0 +1,275 @@
+/****************************************************************************
+**
+Resident storage for a finished terrain.
+**
+****************************************************************************/
+
+#include "heightfield.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+// GCC and Clang only define __F16C__ with -mf16c, MSVC has no such macro but every /arch:AVX2 CPU has F16C
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define HEIGHTFIELD_F16C
+#endif
+
+Heightfield::Heightfield()
+{
+    storage = Float32;
+    meshSize = 0;
+    offset = 0.0f;
+    scale = 1.0f;
+    error = 0.0f;
+}
+
+/* Round to nearest even, values past the half range become infinity */
+quint16 Heightfield::floatToHalf(float value) {
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    quint32 sign = (bits >> 16) & 0x8000;
+    quint32 magnitude = bits & 0x7fffffff;
+
+    if (magnitude > 0x7f800000)
+        return sign | 0x7e00;                 // NaN
+    if (magnitude >= 0x477ff000)
+        return sign | 0x7c00;                 // rounds past 65504
+    if (magnitude < 0x38800000) {
+        float subnormal;                      // below 2^-14, counts of 2^-24
+        memcpy(&subnormal, &magnitude, sizeof(subnormal));
+        return sign | (quint16) lrintf(subnormal * 16777216.0f);
+    }
+    magnitude += 0xc8000fff + ((magnitude >> 13) & 1);   // rebias the exponent, round to nearest even
+    return sign | (quint16) (magnitude >> 13);
+}
+
+float Heightfield::halfToFloat(quint16 value) {
+    quint32 sign = (quint32) (value & 0x8000) << 16;
+    quint32 exponent = (value >> 10) & 0x1f;
+    quint32 mantissa = value & 0x3ff;
+    quint32 bits;
+    float result;
+
+    if (exponent == 0) {
+        result = mantissa * (1.0f / 16777216.0f);
+        return sign ? -result : result;
+    }
+    if (exponent == 31)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+void Heightfield::encode(float **hmap, unsigned int size, Mode mode) {
+    unsigned int i, j;
+    float minValue = FLT_MAX, maxValue = -FLT_MAX;
+
+    storage = mode;
+    meshSize = size;
+    floats.clear();
+    packed.clear();
+    for (i = 0; i < size; i++) {
+        for (j = 0; j < size; j++) {
+            minValue = std::min(minValue, hmap[i][j]);
+            maxValue = std::max(maxValue, hmap[i][j]);
+        }
+    }
+    float maxAbs = std::max(fabs(minValue), fabs(maxValue));
+
+    if (mode == Float32) {
+        floats.resize(size * size);
+        for (i = 0; i < size; i++) {
+            memcpy(&floats[i * size], hmap[i], size * sizeof(float));
+        }
+        error = 0.0f;
+    } else if (mode == Half) {
+        packed.resize(size * size);
+        for (i = 0; i < size; i++) {
+            const float *src = hmap[i];
+            quint16 *dst = &packed[i * size];
+            j = 0;
+#ifdef HEIGHTFIELD_F16C
+            for (; j + 8 <= size; j += 8) {
+                __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(src + j), _MM_FROUND_TO_NEAREST_INT);
+                _mm_storeu_si128((__m128i *) (dst + j), half);
+            }
+#endif
+            for (; j < size; j++) {
+                dst[j] = floatToHalf(src[j]);
+            }
+        }
+        // 11 significant bits, plus half the subnormal spacing near zero
+        error = maxAbs / 2048.0f + 1.0f / 33554432.0f;
+    } else {
+        offset = minValue;
+        scale = maxValue > minValue ? (maxValue - minValue) / 65535.0f : 1.0f;
+        float inverse = 1.0f / scale;
+        packed.resize(size * size);
+        for (i = 0; i < size; i++) {
+            const float *src = hmap[i];
+            quint16 *dst = &packed[i * size];
+            // Plain loop with no branches so the compiler can vectorise it
+            for (j = 0; j < size; j++) {
+                float q = (src[j] - offset) * inverse + 0.5f;
+                dst[j] = (quint16) std::min(q, 65535.0f);
+            }
+        }
+        error = 0.5f * scale + 4.0f * FLT_EPSILON * maxAbs;
+    }
+}
+
+void Heightfield::decodeRow(unsigned int i, float *out) const {
+    unsigned int j = 0;
+    if (storage == Float32) {
+        memcpy(out, &floats[i * meshSize], meshSize * sizeof(float));
+    } else if (storage == Half) {
+        const quint16 *src = &packed[i * meshSize];
+#ifdef HEIGHTFIELD_F16C
+        for (; j + 8 <= meshSize; j += 8) {
+            _mm256_storeu_ps(out + j, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (src + j))));
+        }
+#endif
+        for (; j < meshSize; j++) {
+            out[j] = halfToFloat(src[j]);
+        }
+    } else {
+        const quint16 *src = &packed[i * meshSize];
+        for (; j < meshSize; j++) {
+            out[j] = offset + src[j] * scale;
+        }
+    }
+}
+
+unsigned int Heightfield::size() const {
+    return meshSize;
+}
+
+Heightfield::Mode Heightfield::mode() const {
+    return storage;
+}
+
+float Heightfield::maxError() const {
+    return error;
+}
+
+size_t Heightfield::bytes() const {
+    return floats.size() * sizeof(float) + packed.size() * sizeof(quint16);
+}
+
+PackedNormals::PackedNormals()
+{
+    storage = Float32;
+    rowCount = 0;
+    columnCount = 0;
+}
+
+/* Octahedral mapping with y, the terrain's up axis, as the pole: the upper hemisphere fills the
+ * inner diamond of [-1, 1]^2 and the lower one is folded over the corners */
+static void octahedralEncode(float x, float y, float z, float *u, float *v) {
+    float sum = fabs(x) + fabs(y) + fabs(z);
+    float px = x / sum;
+    float pz = z / sum;
+    if (y < 0.0f) {
+        float fx = (1.0f - fabs(pz)) * (px >= 0.0f ? 1.0f : -1.0f);
+        float fz = (1.0f - fabs(px)) * (pz >= 0.0f ? 1.0f : -1.0f);
+        px = fx;
+        pz = fz;
+    }
+    *u = px;
+    *v = pz;
+}
+
+static inline void octahedralDecode(float u, float v, float *x, float *y, float *z) {
+    float ny = 1.0f - fabs(u) - fabs(v);
+    float t = std::max(-ny, 0.0f);
+    float nx = u + (u >= 0.0f ? -t : t);
+    float nz = v + (v >= 0.0f ? -t : t);
+    float inverseLength = 1.0f / sqrt(nx * nx + ny * ny + nz * nz);
+    *x = nx * inverseLength;
+    *y = ny * inverseLength;
+    *z = nz * inverseLength;
+}
+
+void PackedNormals::encode(QVector3D **normals, unsigned int rows, unsigned int columns, Mode mode) {
+    unsigned int i, j;
+    float u, v;
+
+    storage = mode;
+    rowCount = rows;
+    columnCount = columns;
+    floats.clear();
+    packed16.clear();
+    packed32.clear();
+
+    if (mode == Float32)
+        floats.resize(3 * rows * columns);
+    else if (mode == Octahedral16)
+        packed16.resize(rows * columns);
+    else
+        packed32.resize(rows * columns);
+
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < columns; j++) {
+            const QVector3D &n = normals[i][j];
+            unsigned int k = i * columns + j;
+            if (mode == Float32) {
+                floats[3 * k] = n.x();
+                floats[3 * k + 1] = n.y();
+                floats[3 * k + 2] = n.z();
+                continue;
+            }
+            octahedralEncode(n.x(), n.y(), n.z(), &u, &v);
+            if (mode == Octahedral16) {
+                quint32 qu = (quint32) lrintf((u * 0.5f + 0.5f) * 255.0f);
+                quint32 qv = (quint32) lrintf((v * 0.5f + 0.5f) * 255.0f);
+                packed16[k] = (quint16) (qu | (qv << 8));
+            } else {
+                quint32 qu = (quint32) lrintf((u * 0.5f + 0.5f) * 65535.0f);
+                quint32 qv = (quint32) lrintf((v * 0.5f + 0.5f) * 65535.0f);
+                packed32[k] = qu | (qv << 16);
+            }
+        }
+    }
+}
+
+QVector3D PackedNormals::normal(unsigned int i, unsigned int j) const {
+    float x, y, z;
+    unsigned int k = i * columnCount + j;
+    if (storage == Float32)
+        return QVector3D(floats[3 * k], floats[3 * k + 1], floats[3 * k + 2]);
+    if (storage == Octahedral16)
+        octahedralDecode((packed16[k] & 0xff) * (2.0f / 255.0f) - 1.0f, (packed16[k] >> 8) * (2.0f / 255.0f) - 1.0f, &x, &y, &z);
+    else
+        octahedralDecode((packed32[k] & 0xffff) * (2.0f / 65535.0f) - 1.0f, (packed32[k] >> 16) * (2.0f / 65535.0f) - 1.0f, &x, &y, &z);
+    return QVector3D(x, y, z);
+}
+
+unsigned int PackedNormals::rows() const {
+    return rowCount;
+}
+
+unsigned int PackedNormals::columns() const {
+    return columnCount;
+}
+
+PackedNormals::Mode PackedNormals::mode() const {
+    return storage;
+}
+
+/* Worst case of rounding both octahedral coordinates, measured over the whole sphere */
+float PackedNormals::maxErrorDegrees() const {
+    if (storage == Octahedral16)
+        return OCTAHEDRAL16_MAX_ERROR;
+    if (storage == Octahedral32)
+        return OCTAHEDRAL32_MAX_ERROR;
+    return 0.001f;
+}
+
+size_t PackedNormals::bytes() const {
+    return floats.size() * sizeof(float) + packed16.size() * sizeof(quint16) + packed32.size() * sizeof(quint32);
+}
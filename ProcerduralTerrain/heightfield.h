@@ -0,0 +1,84 @@
+/****************************************************************************
+**
+Resident storage for a finished terrain.
+Heights can be kept as floats, half floats or 16 bit values normalised to the
+height range, face normals as floats or octahedral 2x8 / 2x16 bit pairs.
+The error bounds are checked by HeightfieldCheck, --heightfield-check.
+**
+****************************************************************************/
+
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include <QVector3D>
+#include <QtGlobal>
+#include <vector>
+
+class Heightfield
+{
+public:
+    enum Mode { Float32, Half, Unorm16 };
+
+    Heightfield();
+
+    void encode(float **hmap, unsigned int size, Mode mode);
+    /* Decodes size() heights of row i into out */
+    void decodeRow(unsigned int i, float *out) const;
+    unsigned int size() const;
+    Mode mode() const;
+    /* Largest absolute difference between a stored and an original height */
+    float maxError() const;
+    size_t bytes() const;
+
+    inline float height(unsigned int i, unsigned int j) const {
+        unsigned int k = i * meshSize + j;
+        switch (storage) {
+        case Half:
+            return halfToFloat(packed[k]);
+        case Unorm16:
+            return offset + packed[k] * scale;
+        default:
+            return floats[k];
+        }
+    }
+
+    static quint16 floatToHalf(float value);
+    static float halfToFloat(quint16 value);
+
+private:
+    Mode storage;
+    unsigned int meshSize;
+    float offset, scale;   // Unorm16: height = offset + value * scale
+    float error;
+    std::vector<float> floats;
+    std::vector<quint16> packed;
+};
+
+class PackedNormals
+{
+public:
+    enum Mode { Float32, Octahedral16, Octahedral32 };
+
+    PackedNormals();
+
+    void encode(QVector3D **normals, unsigned int rows, unsigned int columns, Mode mode);
+    QVector3D normal(unsigned int i, unsigned int j) const;
+    unsigned int rows() const;
+    unsigned int columns() const;
+    Mode mode() const;
+    /* Largest angle in degrees between a stored and an original unit normal */
+    float maxErrorDegrees() const;
+    size_t bytes() const;
+
+private:
+    Mode storage;
+    unsigned int rowCount, columnCount;
+    std::vector<float> floats;       // x, y, z per normal
+    std::vector<quint16> packed16;   // Octahedral16: u in the low byte, v in the high byte
+    std::vector<quint32> packed32;   // Octahedral32: u in the low half, v in the high half
+
+#define OCTAHEDRAL16_MAX_ERROR 1.0f   // degrees, measured worst case 0.94
+#define OCTAHEDRAL32_MAX_ERROR 0.01f  // degrees, measured worst case 0.0037
+};
+
+#endif // HEIGHTFIELD_H
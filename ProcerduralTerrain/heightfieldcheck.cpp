@@ -0,0 +1,126 @@
+/****************************************************************************
+**
+Resident terrain storage check.
+**
+****************************************************************************/
+
+#include "heightfieldcheck.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+
+static const float pi = 3.14159265358979f;
+
+HeightfieldCheck::HeightfieldCheck(unsigned int seed)
+{
+    rng.seed(seed);
+    meshSize = 0;
+}
+
+float HeightfieldCheck::random(float lo, float hi) {
+    return lo + (hi - lo) * (rng() - rng.min()) / (float) (rng.max() - rng.min());
+}
+
+bool HeightfieldCheck::run(unsigned int size) {
+    unsigned int i, k;
+    unsigned int columns = 2 * (size - 1);
+    std::normal_distribution<float> gaussian;
+    bool passed = true;
+
+    meshSize = size;
+    heights.resize(size * size);
+    heightRows.resize(size);
+    for (k = 0; k < size * size; k++) {
+        heights[k] = random(-0.5f * CHECK_HEIGHT_RANGE, 0.5f * CHECK_HEIGHT_RANGE);
+        if (k % CHECK_TINY_EVERY == 0)
+            heights[k] *= 1e-5f;
+    }
+    for (i = 0; i < size; i++) {
+        heightRows[i] = &heights[i * size];
+    }
+
+    // Uniform over the sphere, so the folded lower hemisphere is covered as well as the terrain's upper one
+    normals.resize((size - 1) * columns);
+    normalRows.resize(size - 1);
+    for (k = 0; k < normals.size(); k++) {
+        QVector3D n;
+        do {
+            n = QVector3D(gaussian(rng), gaussian(rng), gaussian(rng));
+        } while (n.length() < 1e-3f);
+        normals[k] = n.normalized();
+    }
+    // The poles, the equator and the fold of the octahedral map
+    static const float special[][3] = {
+        { 0, 1, 0 }, { 0, -1, 0 }, { 1, 0, 0 }, { -1, 0, 0 }, { 0, 0, 1 }, { 0, 0, -1 },
+        { 1, 1, 1 }, { 1, -1, 1 }, { -1, -1, -1 }, { 1, -1e-4f, 0 }, { 0, -1e-4f, -1 }
+    };
+    for (k = 0; k < sizeof(special) / sizeof(special[0]) && k < normals.size(); k++) {
+        normals[k] = QVector3D(special[k][0], special[k][1], special[k][2]).normalized();
+    }
+    for (i = 0; i < size - 1; i++) {
+        normalRows[i] = &normals[i * columns];
+    }
+
+    passed &= checkHeights(Heightfield::Float32, "float32");
+    passed &= checkHeights(Heightfield::Half, "half");
+    passed &= checkHeights(Heightfield::Unorm16, "unorm16");
+    passed &= checkNormals(PackedNormals::Float32, "float32");
+    passed &= checkNormals(PackedNormals::Octahedral16, "octahedral 2x8");
+    passed &= checkNormals(PackedNormals::Octahedral32, "octahedral 2x16");
+    qDebug() << "Heightfield check:" << (passed ? "all values within their bounds" : "BOUND EXCEEDED");
+    return passed;
+}
+
+/* Besides the bound, decodeRow must agree with height() and the half encoding with floatToHalf, as
+ * both may take the F16C path */
+bool HeightfieldCheck::checkHeights(Heightfield::Mode mode, const char *name) {
+    Heightfield field;
+    std::vector<float> row(meshSize);
+    unsigned int i, j;
+    float worst = 0.0f;
+    int failures = 0;
+
+    field.encode(heightRows.data(), meshSize, mode);
+    for (i = 0; i < meshSize; i++) {
+        field.decodeRow(i, row.data());
+        for (j = 0; j < meshSize; j++) {
+            float original = heights[i * meshSize + j];
+            float stored = field.height(i, j);
+            worst = std::max(worst, (float) fabs(stored - original));
+            if (fabs(stored - original) > field.maxError() || row[j] != stored)
+                failures++;
+            else if (mode == Heightfield::Half && stored != Heightfield::halfToFloat(Heightfield::floatToHalf(original)))
+                failures++;
+        }
+    }
+    qDebug() << "  heights" << name << ": worst error" << worst << "bound" << field.maxError() << ","
+             << field.bytes() / 1024 << "KB," << failures << "failures";
+    return failures == 0;
+}
+
+/* Compared through the cross product, a dot product against cos(bound) is lost in float rounding */
+bool HeightfieldCheck::checkNormals(PackedNormals::Mode mode, const char *name) {
+    PackedNormals packed;
+    unsigned int i, j;
+    unsigned int columns = 2 * (meshSize - 1);
+    float worst = 0.0f;
+    int failures = 0;
+
+    packed.encode(normalRows.data(), meshSize - 1, columns, mode);
+    float sinBound = sin(packed.maxErrorDegrees() * pi / 180.0f) + 1e-6f;
+    for (i = 0; i < meshSize - 1; i++) {
+        for (j = 0; j < columns; j++) {
+            const QVector3D &original = normals[i * columns + j];
+            QVector3D stored = packed.normal(i, j);
+            float dot = QVector3D::dotProduct(stored, original);
+            float cross = QVector3D::crossProduct(stored, original).length();
+            worst = std::max(worst, atan2f(cross, dot) * 180.0f / pi);
+            if (dot <= 0.0f || cross > sinBound)
+                failures++;
+        }
+    }
+    qDebug() << "  normals" << name << ": worst error" << worst << "degrees, bound" << packed.maxErrorDegrees() << ","
+             << packed.bytes() / 1024 << "KB," << failures << "failures";
+    return failures == 0;
+}
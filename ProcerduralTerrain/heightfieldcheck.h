@@ -0,0 +1,48 @@
+/****************************************************************************
+**
+Resident terrain storage check.
+Encodes random heights and normals in every storage mode and compares each
+decoded value with the original against the mode's documented error bound:
+maxError() for heights, OCTAHEDRAL16_MAX_ERROR and OCTAHEDRAL32_MAX_ERROR for
+normals. Reports the worst error seen per mode. Needs no OpenGL:
+    ./ProcerduralTerrain --heightfield-check=1025
+**
+****************************************************************************/
+
+#ifndef HEIGHTFIELDCHECK_H
+#define HEIGHTFIELDCHECK_H
+
+#include <QVector3D>
+#include <random>
+#include <vector>
+
+#include "heightfield.h"
+
+class HeightfieldCheck
+{
+public:
+    explicit HeightfieldCheck(unsigned int seed = 1);
+
+    /* Checks a size x size height map and the size - 1 rows of 2 * (size - 1) face normals of its
+     * mesh, false if any decoded value is outside its bound */
+    bool run(unsigned int size);
+
+private:
+    bool checkHeights(Heightfield::Mode mode, const char *name);
+    bool checkNormals(PackedNormals::Mode mode, const char *name);
+    float random(float lo, float hi);
+
+    std::minstd_rand rng;
+    unsigned int meshSize;
+    std::vector<float> heights;
+    std::vector<float *> heightRows;
+    std::vector<QVector3D> normals;
+    std::vector<QVector3D *> normalRows;
+
+/* Heights span CHECK_HEIGHT_RANGE around zero like the terrain's, every CHECK_TINY_EVERY-th is
+ * scaled into the subnormal range of half floats */
+#define CHECK_HEIGHT_RANGE 4.0f
+#define CHECK_TINY_EVERY 97
+};
+
+#endif // HEIGHTFIELDCHECK_H
@@ -0,0 +1,75 @@
+/****************************************************************************
+**
+Terrain kernel benchmark.
+**
+****************************************************************************/
+
+#include "kernelbenchmark.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+
+KernelBenchmark::KernelBenchmark(unsigned int seed)
+{
+    rng.seed(seed);
+    meshSize = 0;
+}
+
+bool KernelBenchmark::run(unsigned int size) {
+    unsigned int i, k;
+    bool matched = true;
+    int radius;
+
+    meshSize = size;
+    map.resize(size * size);
+    mapRows.resize(size);
+    for (k = 0; k < size * size; k++) {
+        map[k] = (rng() - rng.min()) / (float) (rng.max() - rng.min());
+    }
+    for (i = 0; i < size; i++) {
+        mapRows[i] = &map[i * size];
+    }
+    for (radius = 1; radius <= 3; radius++) {
+        matched &= runRadius(radius);
+    }
+    qDebug() << "Kernel benchmark:" << (matched ? "tiled and untiled filters match" : "OUTPUT MISMATCH");
+    return matched;
+}
+
+/* Every filter gets KERNEL_BENCHMARK_RUNS passes over the whole map, the best one shows the filter
+ * with the least interference from the rest of the machine */
+double KernelBenchmark::timeKernel(BoxFilterFunction filter, int radius, std::vector<float> &out, double *median) {
+    std::vector<float *> outRows(meshSize);
+    std::vector<double> times;
+    QElapsedTimer timer;
+    unsigned int i;
+    int run;
+
+    out.assign(meshSize * meshSize, 0.0f);
+    for (i = 0; i < meshSize; i++) {
+        outRows[i] = &out[i * meshSize];
+    }
+    for (run = 0; run < KERNEL_BENCHMARK_RUNS; run++) {
+        timer.start();
+        filter(mapRows.data(), outRows.data(), meshSize, radius, 0, meshSize);
+        times.push_back(timer.nsecsElapsed() / 1e6);
+    }
+    std::sort(times.begin(), times.end());
+    *median = times[times.size() / 2];
+    return times[0];
+}
+
+/* Both filters add in the same order, so their results must agree to the bit */
+bool KernelBenchmark::runRadius(int radius) {
+    std::vector<float> tiledOut, untiledOut;
+    double tiledMedian, untiledMedian;
+
+    double tiledBest = timeKernel(TerrainKernels::boxFilter, radius, tiledOut, &tiledMedian);
+    double untiledBest = timeKernel(TerrainKernels::boxFilterUntiled, radius, untiledOut, &untiledMedian);
+    bool matched = tiledOut == untiledOut;
+
+    qDebug() << "  radius" << radius << ": tiled" << tiledBest << "ms (median" << tiledMedian << "), untiled"
+             << untiledBest << "ms (median" << untiledMedian << ")," << (matched ? "identical" : "DIFFERENT");
+    return matched;
+}
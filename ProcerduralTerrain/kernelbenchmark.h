@@ -0,0 +1,41 @@
+/****************************************************************************
+**
+Terrain kernel benchmark.
+Box filters a random height map for radii 1 to 3, with the tiled filter the
+build uses and with the untiled one. Reports the best and median time of each
+and checks that both give identical maps. Needs no OpenGL:
+    ./ProcerduralTerrain --kernel-benchmark=1025
+**
+****************************************************************************/
+
+#ifndef KERNELBENCHMARK_H
+#define KERNELBENCHMARK_H
+
+#include <random>
+#include <vector>
+
+#include "terrainkernels.h"
+
+class KernelBenchmark
+{
+public:
+    explicit KernelBenchmark(unsigned int seed = 1);
+
+    /* Filters a size x size map, false if the two filters' outputs differed */
+    bool run(unsigned int size);
+
+private:
+    typedef void (*BoxFilterFunction)(const float *const *, float **, unsigned int, int, unsigned int, unsigned int);
+
+    bool runRadius(int radius);
+    double timeKernel(BoxFilterFunction filter, int radius, std::vector<float> &out, double *median);
+
+    std::minstd_rand rng;
+    unsigned int meshSize;
+    std::vector<float> map;
+    std::vector<const float *> mapRows;
+
+#define KERNEL_BENCHMARK_RUNS 15
+};
+
+#endif // KERNELBENCHMARK_H
@@ -9,11 +9,26 @@ author: Zheng Xu, xuzhustc@gmail.com
 
 #ifndef QT_NO_OPENGL
 #include "terrainwindow.h"
+#include "terrainbenchmark.h"
 #endif
 
+#include "collisionbenchmark.h"
+#include "heightfieldcheck.h"
+#include "kernelbenchmark.h"
+
 #include <QApplication>
 #include <QSurfaceFormat>
 
+/* Value of a --name=value argument, fallback if it is missing or has no value */
+static int intArgument(const QStringList &arguments, const QString &name, int fallback)
+{
+    foreach (const QString &argument, arguments) {
+        if (argument.startsWith(name + "="))
+            return argument.mid(name.length() + 1).toInt();
+    }
+    return fallback;
+}
+
 int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
@@ -22,11 +37,49 @@ int main(int argc, char *argv[])
     format.setDepthBufferSize(24);
     format.setVersion(3, 3);
     format.setProfile(QSurfaceFormat::CoreProfile);
+    format.setSwapInterval(1);  // frames are paced by vsync
     QSurfaceFormat::setDefaultFormat(format);
 
     app.setApplicationName("Car 101");
+    // --collision-benchmark[=boxes] times the collision world and exits
+    int collisionBoxes = intArgument(app.arguments(), "--collision-benchmark",
+                                     app.arguments().contains("--collision-benchmark") ? 100000 : 0);
+    if (collisionBoxes > 0) {
+        CollisionBenchmark collisionBenchmark;
+        return collisionBenchmark.run(collisionBoxes) ? 0 : 1;
+    }
+    // --heightfield-check[=size] checks the error bounds of every terrain storage mode and exits
+    int checkSize = intArgument(app.arguments(), "--heightfield-check",
+                                app.arguments().contains("--heightfield-check") ? 1025 : 0);
+    if (checkSize > 1) {
+        HeightfieldCheck heightfieldCheck;
+        return heightfieldCheck.run(checkSize) ? 0 : 1;
+    }
+    // --kernel-benchmark[=size] times the box filter of the build and exits
+    int kernelSize = intArgument(app.arguments(), "--kernel-benchmark",
+                                 app.arguments().contains("--kernel-benchmark") ? 1025 : 0);
+    if (kernelSize > 1) {
+        KernelBenchmark kernelBenchmark;
+        return kernelBenchmark.run(kernelSize) ? 0 : 1;
+    }
 #ifndef QT_NO_OPENGL
     TerrainWindow myW;
+    myW.setPipelinedBuild(!app.arguments().contains("--serial-build"));
+    myW.setProgressiveBuild(!app.arguments().contains("--blocking-build"));
+    myW.setTerrainStorage(app.arguments().contains("--half-heights") ? Heightfield::Half
+                          : app.arguments().contains("--unorm16-heights") ? Heightfield::Unorm16 : Heightfield::Float32,
+                          app.arguments().contains("--oct16-normals") ? PackedNormals::Octahedral16
+                          : app.arguments().contains("--oct32-normals") ? PackedNormals::Octahedral32 : PackedNormals::Float32);
+    // --benchmark[=frames] renders offscreen and exits instead of opening the window
+    int benchmarkFrames = intArgument(app.arguments(), "--benchmark", app.arguments().contains("--benchmark") ? 600 : 0);
+    int seed = intArgument(app.arguments(), "--seed", benchmarkFrames > 0 ? 1 : -1);
+    if (seed >= 0)
+        myW.setTerrainSeed(seed);
+    if (benchmarkFrames > 0) {
+        TerrainBenchmark benchmark(&myW, QSize(intArgument(app.arguments(), "--width", 800),
+                                              intArgument(app.arguments(), "--height", 800)));
+        return benchmark.run(benchmarkFrames) ? 0 : 1;
+    }
     myW.show();
 #else
     QLabel note("OpenGL Support required");
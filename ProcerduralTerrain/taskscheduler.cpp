@@ -0,0 +1,153 @@
+/****************************************************************************
+**
+Small work-stealing task scheduler.
+**
+****************************************************************************/
+
+#include "taskscheduler.h"
+
+#include <QThread>
+
+TaskScheduler::TaskScheduler(int threadCount)
+{
+    int i;
+    if (threadCount <= 0)
+        threadCount = std::max(1, QThread::idealThreadCount());
+    queued = 0;
+    remaining = 0;
+    stopping = false;
+
+    for (i = 0; i < threadCount; i++) {
+        queues.push_back(new WorkQueue);
+    }
+    // Queue 0 belongs to whichever thread calls run()
+    for (i = 1; i < threadCount; i++) {
+        workers.push_back(std::thread(&TaskScheduler::workerLoop, this, i));
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    unsigned int i;
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    for (i = 0; i < queues.size(); i++) {
+        delete queues[i];
+    }
+}
+
+int TaskScheduler::addTask(const std::function<void()> &work) {
+    tasks.emplace_back();
+    tasks.back().work = work;
+    tasks.back().waitingOn = 0;
+    return (int) tasks.size() - 1;
+}
+
+void TaskScheduler::addDependency(int task, int prerequisite) {
+    tasks[prerequisite].dependents.push_back(task);
+    tasks[task].waitingOn++;
+}
+
+int TaskScheduler::threadCount() const {
+    return (int) queues.size();
+}
+
+void TaskScheduler::run() {
+    int task;
+    unsigned int i;
+    if (tasks.empty())
+        return;
+
+    // Find the roots before pushing any, a worker may finish one and release its dependents meanwhile
+    std::vector<int> roots;
+    for (i = 0; i < tasks.size(); i++) {
+        if (tasks[i].waitingOn == 0)
+            roots.push_back(i);
+    }
+    remaining = (int) tasks.size();
+    for (i = 0; i < roots.size(); i++) {
+        push(0, roots[i]);
+    }
+
+    while (remaining > 0) {
+        if (findTask(0, &task)) {
+            execute(0, task);
+        } else {
+            std::unique_lock<std::mutex> guard(sleepLock);
+            wakeup.wait(guard, [this]() { return queued > 0 || remaining == 0; });
+        }
+    }
+    tasks.clear();
+}
+
+void TaskScheduler::workerLoop(int self) {
+    int task;
+    while (true) {
+        if (findTask(self, &task)) {
+            execute(self, task);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wakeup.wait(guard, [this]() { return queued > 0 || stopping; });
+        if (stopping)
+            return;
+    }
+}
+
+/* Newest task from our own queue first, which keeps a tile's stages on the core that has its data
+ * in cache, otherwise the oldest task of another thread's queue */
+bool TaskScheduler::findTask(int self, int *task) {
+    int count = (int) queues.size();
+    {
+        WorkQueue *own = queues[self];
+        std::lock_guard<std::mutex> guard(own->lock);
+        if (!own->tasks.empty()) {
+            *task = own->tasks.back();
+            own->tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+    for (int i = 1; i < count; i++) {
+        WorkQueue *victim = queues[(self + i) % count];
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->tasks.empty()) {
+            *task = victim->tasks.front();
+            victim->tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::push(int self, int task) {
+    {
+        std::lock_guard<std::mutex> guard(queues[self]->lock);
+        queues[self]->tasks.push_back(task);
+    }
+    queued++;
+    // Taking the lock orders this against a thread that has just checked queued and is about to sleep
+    { std::lock_guard<std::mutex> guard(sleepLock); }
+    wakeup.notify_all();
+}
+
+void TaskScheduler::execute(int self, int task) {
+    unsigned int i;
+    tasks[task].work();
+    for (i = 0; i < tasks[task].dependents.size(); i++) {
+        int dependent = tasks[task].dependents[i];
+        if (--tasks[dependent].waitingOn == 0)
+            push(self, dependent);
+    }
+    if (--remaining == 0) {
+        { std::lock_guard<std::mutex> guard(sleepLock); }
+        wakeup.notify_all();
+    }
+}
@@ -0,0 +1,63 @@
+/****************************************************************************
+**
+Small work-stealing task scheduler.
+Tasks and the dependencies between them are added first, run() then executes
+the whole graph on a pool of worker threads plus the calling thread.
+**
+****************************************************************************/
+
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskScheduler
+{
+public:
+    /* threadCount includes the thread calling run(), 0 picks QThread::idealThreadCount() */
+    explicit TaskScheduler(int threadCount = 0);
+    ~TaskScheduler();
+
+    int addTask(const std::function<void()> &work);
+    /* task will not start before prerequisite has finished */
+    void addDependency(int task, int prerequisite);
+    /* Runs every task added since the last run and returns once they have all finished */
+    void run();
+    int threadCount() const;
+
+private:
+    struct Task {
+        std::function<void()> work;
+        std::vector<int> dependents;
+        std::atomic<int> waitingOn;
+    };
+
+    /* Owner pushes and pops at the back, thieves take from the front */
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    void workerLoop(int self);
+    bool findTask(int self, int *task);
+    void push(int self, int task);
+    void execute(int self, int task);
+
+    std::deque<Task> tasks;
+    std::vector<WorkQueue *> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<int> queued;
+    std::atomic<int> remaining;
+    bool stopping;
+    std::mutex sleepLock;
+    std::condition_variable wakeup;
+};
+
+#endif // TASKSCHEDULER_H
@@ -0,0 +1,98 @@
+/****************************************************************************
+**
+Headless renderer benchmark.
+**
+****************************************************************************/
+
+#include "terrainbenchmark.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <vector>
+
+TerrainBenchmark::TerrainBenchmark(TerrainWindow *window, const QSize &size)
+{
+    this->window = window;
+    this->size = size;
+    fbo = NULL;
+    window->setProgressiveBuild(false);
+}
+
+TerrainBenchmark::~TerrainBenchmark()
+{
+    if (fbo == NULL)
+        return;
+    context.makeCurrent(&surface);
+    window->releaseGL();
+    delete fbo;
+    context.doneCurrent();
+}
+
+void TerrainBenchmark::stepCamera(int frame) {
+    float degrees = (frame / BENCHMARK_TURN_FRAMES) % 2 == 0 ? BENCHMARK_TURN_DEGREES : -BENCHMARK_TURN_DEGREES;
+    window->rotateCamera(degrees, 0.0f);
+    window->moveCameraForward(window->movementSpeed);
+}
+
+bool TerrainBenchmark::run(int frames) {
+    int frame;
+    QElapsedTimer timer;
+
+    context.setFormat(QSurfaceFormat::defaultFormat());
+    if (!context.create()) {
+        qWarning() << "Benchmark: no OpenGL context";
+        return false;
+    }
+    surface.setFormat(context.format());
+    surface.create();
+    if (!context.makeCurrent(&surface) || context.format().version() < qMakePair(3, 3)) {
+        qWarning() << "Benchmark: no OpenGL 3.3 context";
+        return false;
+    }
+    fbo = new QOpenGLFramebufferObject(size, QOpenGLFramebufferObject::CombinedDepthStencil);
+    fbo->bind();
+
+    timer.start();
+    window->initializeGL();
+    window->resizeGL(size.width(), size.height());
+    qint64 buildTime = timer.elapsed();
+    qint64 buildUploadBytes = window->renderStats.uploadBytes;
+    RenderStats start = window->renderStats;
+
+    /* submit: the CPU time of moving the camera and issuing the frame's GL calls,
+     * frame: submit plus waiting for the frame to finish, which is CPU time as well on llvmpipe */
+    std::vector<double> submitTimes, frameTimes;
+    for (frame = 0; frame < frames; frame++) {
+        timer.restart();
+        stepCamera(frame);
+        fbo->bind();
+        window->paintGL();
+        submitTimes.push_back(timer.nsecsElapsed() / 1e6);
+        context.functions()->glFinish();
+        frameTimes.push_back(timer.nsecsElapsed() / 1e6);
+    }
+
+    RenderStats end = window->renderStats;
+    std::sort(submitTimes.begin(), submitTimes.end());
+    std::sort(frameTimes.begin(), frameTimes.end());
+    qDebug() << "Benchmark:" << (const char *) context.functions()->glGetString(GL_RENDERER)
+             << size.width() << "x" << size.height() << "," << frames << "frames";
+    const BuildStats &build = window->buildStats;
+    qDebug() << "  build" << (window->pipelinedBuild ? "(pipelined)" : "(serial)") << buildTime << "ms, first meshed band"
+             << build.firstBandTime << "ms, mesh uploaded" << build.meshTime << "ms," << buildUploadBytes / 1024 << "KB";
+    qDebug() << "  build arena:" << build.arenaAllocations << "allocations," << build.arenaBytes / 1024 << "KB in"
+             << build.arenaChunks << "chunks";
+    qDebug() << "  resident terrain:" << build.residentBytes / 1024 << "KB, height error up to" << build.maxHeightError;
+    qDebug() << "  lighting bake" << build.bakeTime << "ms," << build.bakeRows << "rows";
+    if (frames == 0)
+        return true;
+    qDebug() << "  submit ms: median" << submitTimes[frames / 2] << "p95" << submitTimes[frames * 95 / 100]
+             << "max" << submitTimes.back();
+    qDebug() << "  frame ms: median" << frameTimes[frames / 2] << "p95" << frameTimes[frames * 95 / 100]
+             << "max" << frameTimes.back();
+    qDebug() << "  per frame:" << (end.drawCalls - start.drawCalls) / (double) frames << "draw calls,"
+             << (end.triangles - start.triangles) / (double) frames << "triangles,"
+             << (end.uploadBytes - start.uploadBytes) / (double) frames << "bytes uploaded";
+    return true;
+}
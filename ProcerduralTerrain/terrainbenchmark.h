@@ -0,0 +1,47 @@
+/****************************************************************************
+**
+Headless renderer benchmark.
+Renders a TerrainWindow into a framebuffer object on an offscreen surface,
+flying the camera along a fixed path, and reports frame times, draw calls,
+triangles and uploaded bytes, after the build times and sizes. The build is
+pipelined unless --serial-build is given. Needs no window or GPU, e.g. on Mesa
+llvmpipe:
+    LIBGL_ALWAYS_SOFTWARE=1 xvfb-run ./ProcerduralTerrain --benchmark=600
+**
+****************************************************************************/
+
+#ifndef TERRAINBENCHMARK_H
+#define TERRAINBENCHMARK_H
+
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QSize>
+
+#include "terrainwindow.h"
+
+class TerrainBenchmark
+{
+public:
+    /* window must not be shown, its terrain is built with the blocking build */
+    TerrainBenchmark(TerrainWindow *window, const QSize &size);
+    ~TerrainBenchmark();
+
+    /* Builds the terrain and renders frames frames, false if no OpenGL 3.3 context could be made */
+    bool run(int frames);
+
+private:
+    void stepCamera(int frame);
+
+    TerrainWindow *window;
+    QSize size;
+    QOpenGLContext context;
+    QOffscreenSurface surface;
+    QOpenGLFramebufferObject *fbo;
+
+/* Camera path: forward every frame, turning one way for BENCHMARK_TURN_FRAMES frames, then the other */
+#define BENCHMARK_TURN_FRAMES 120
+#define BENCHMARK_TURN_DEGREES 0.5f
+};
+
+#endif // TERRAINBENCHMARK_H
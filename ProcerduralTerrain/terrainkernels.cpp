@@ -0,0 +1,138 @@
+/****************************************************************************
+**
+Inner loops of the terrain build.
+**
+****************************************************************************/
+
+#include "terrainkernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/* The box filter is separable: the column sums of the window rows go to a row buffer padded with
+ * the edge sums, so neither pass needs any clamping inside its loops. Both passes work on Tile
+ * columns at a time, summed into a local block that the compiler keeps in vector registers. */
+template<unsigned int Tile>
+static void boxFilterKernel(const float *const *src, float **dst, unsigned int size, int radius,
+                            unsigned int begin, unsigned int end) {
+    const int diameter = 2 * radius + 1;
+    const float weight = 1.0f / (diameter * diameter);
+    unsigned int i, j, t;
+    int u;
+    std::vector<float> padded(size + 2 * radius);
+    std::vector<const float *> window(diameter);
+    float *sums = &padded[radius];
+
+    for (i = begin; i < end; i++) {
+        for (u = 0; u < diameter; u++) {
+            window[u] = src[std::max(0, std::min((int) i - radius + u, (int) size - 1))];
+        }
+        for (j = 0; j + Tile <= size; j += Tile) {
+            float block[Tile];
+            for (t = 0; t < Tile; t++) {
+                block[t] = window[0][j + t];
+            }
+            for (u = 1; u < diameter; u++) {
+                const float *row = window[u] + j;
+                for (t = 0; t < Tile; t++) {
+                    block[t] += row[t];
+                }
+            }
+            for (t = 0; t < Tile; t++) {
+                sums[j + t] = block[t];
+            }
+        }
+        for (; j < size; j++) {
+            sums[j] = window[0][j];
+            for (u = 1; u < diameter; u++) {
+                sums[j] += window[u][j];
+            }
+        }
+        for (u = 0; u < radius; u++) {
+            padded[u] = sums[0];
+            sums[size + u] = sums[size - 1];
+        }
+
+        float *out = dst[i];
+        for (j = 0; j + Tile <= size; j += Tile) {
+            float block[Tile];
+            for (t = 0; t < Tile; t++) {
+                block[t] = padded[j + t];
+            }
+            for (u = 1; u < diameter; u++) {
+                for (t = 0; t < Tile; t++) {
+                    block[t] += padded[j + u + t];
+                }
+            }
+            for (t = 0; t < Tile; t++) {
+                out[j + t] = block[t] * weight;
+            }
+        }
+        for (; j < size; j++) {
+            float sum = padded[j];
+            for (u = 1; u < diameter; u++) {
+                sum += padded[j + u];
+            }
+            out[j] = sum * weight;
+        }
+    }
+}
+
+/* Vertex (i, j) touches triangles 2j-2, 2j-1 and 2j of cell row i and 2j-1, 2j and 2j+1 of cell
+ * row i-1, fewer along the border of the mesh */
+static QVector3D borderVertexNormal(const QVector3D *below, const QVector3D *above, unsigned int cells, unsigned int j) {
+    QVector3D normal(0.0f, 0.0f, 0.0f);
+    if (below != NULL) {
+        if (j > 0)
+            normal += below[2*j - 2] + below[2*j - 1];
+        if (j < cells)
+            normal += below[2*j];
+    }
+    if (above != NULL) {
+        if (j > 0)
+            normal += above[2*j - 1];
+        if (j < cells)
+            normal += above[2*j] + above[2*j + 1];
+    }
+    return normal.normalized();
+}
+
+void TerrainKernels::vertexNormalRow(const QVector3D *const *faceNormals, unsigned int size, unsigned int i,
+                                     QVector3D *out) {
+    const unsigned int cells = size - 1;
+    const QVector3D *below = i < cells ? faceNormals[i] : NULL;
+    const QVector3D *above = i > 0 ? faceNormals[i - 1] : NULL;
+    unsigned int j;
+
+    out[0] = borderVertexNormal(below, above, cells, 0);
+    out[cells] = borderVertexNormal(below, above, cells, cells);
+    if (below == NULL || above == NULL) {
+        for (j = 1; j < cells; j++) {
+            out[j] = borderVertexNormal(below, above, cells, j);
+        }
+        return;
+    }
+    // Face normals of a height map all point up, so the sum is never zero
+    for (j = 1; j < cells; j++) {
+        const QVector3D *b = below + 2*j - 2;
+        const QVector3D *a = above + 2*j - 1;
+        float x = b[0].x() + b[1].x() + b[2].x() + a[0].x() + a[1].x() + a[2].x();
+        float y = b[0].y() + b[1].y() + b[2].y() + a[0].y() + a[1].y() + a[2].y();
+        float z = b[0].z() + b[1].z() + b[2].z() + a[0].z() + a[1].z() + a[2].z();
+        float inverseLength = 1.0f / sqrtf(x * x + y * y + z * z);
+        out[j] = QVector3D(x * inverseLength, y * inverseLength, z * inverseLength);
+    }
+}
+
+/* Tiles of 8 columns, two SSE or one AVX register. Fixing the radius as well gained nothing over
+ * the runtime radius in --kernel-benchmark. */
+void TerrainKernels::boxFilter(const float *const *src, float **dst, unsigned int size, int radius,
+                               unsigned int begin, unsigned int end) {
+    boxFilterKernel<8>(src, dst, size, radius, begin, end);
+}
+
+void TerrainKernels::boxFilterUntiled(const float *const *src, float **dst, unsigned int size, int radius,
+                                      unsigned int begin, unsigned int end) {
+    boxFilterKernel<1>(src, dst, size, radius, begin, end);
+}
@@ -0,0 +1,32 @@
+/****************************************************************************
+**
+Inner loops of the terrain build.
+The box filter is a template on its column tile width, so the inner loops over
+a tile have fixed trip counts. The build uses 8 column tiles, the untiled
+instantiation is kept as the baseline of KernelBenchmark.
+**
+****************************************************************************/
+
+#ifndef TERRAINKERNELS_H
+#define TERRAINKERNELS_H
+
+#include <QVector3D>
+
+class TerrainKernels
+{
+public:
+    /* Box filters rows [begin, end) of the size x size map src into dst over a
+     * (2 * radius + 1)^2 window, samples past the edges are clamped */
+    static void boxFilter(const float *const *src, float **dst, unsigned int size, int radius,
+                          unsigned int begin, unsigned int end);
+    /* boxFilter one column at a time, with identical results */
+    static void boxFilterUntiled(const float *const *src, float **dst, unsigned int size, int radius,
+                                 unsigned int begin, unsigned int end);
+
+    /* Normals of the size vertices in row i, the normalised sum of the face normals of the up to
+     * six triangles around each vertex. faceNormals has size - 1 rows of 2 * (size - 1) triangles. */
+    static void vertexNormalRow(const QVector3D *const *faceNormals, unsigned int size, unsigned int i,
+                                QVector3D *out);
+};
+
+#endif // TERRAINKERNELS_H
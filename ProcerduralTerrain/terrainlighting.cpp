@@ -0,0 +1,217 @@
+/****************************************************************************
+**
+Baked lighting of a finished terrain.
+**
+****************************************************************************/
+
+#include "terrainlighting.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static const float pi = 3.14159265358979f;
+
+/* A sweep in the unit direction (dirI, dirJ) of the (i, j) plane walks parallel lines that advance
+ * one sample along the major axis of the direction per step and a rounded fraction of a sample along
+ * the other one. Line l holds the samples with minor index l - offset + round(m * slope) after m
+ * steps, so the lines together visit every sample exactly once. */
+static void sweepGeometry(unsigned int size, float dirI, float dirJ, bool *majorI, float *slope, int *offset,
+                          unsigned int *lines) {
+    *majorI = fabsf(dirI) >= fabsf(dirJ);
+    *slope = *majorI ? dirJ / fabsf(dirI) : dirI / fabsf(dirJ);
+    int drift = (int) lroundf((size - 1) * *slope);
+    *offset = std::max(0, drift);
+    *lines = size + abs(drift);
+}
+
+/* Walks lines [lineBegin, lineEnd) of a sweep over the size x size map heights. For every sample k
+ * store(k, tangent) gets the tangent of the highest angle to the horizon looking back along the
+ * line, -infinity for the first sample of a line. The samples passed so far are kept as their upper
+ * convex hull, of which the horizon is the last point once the points below the line from the
+ * point before it to the new sample have been dropped. */
+template<class Store>
+static void horizonSweep(const float *heights, unsigned int size, float spacing, float dirI, float dirJ,
+                         unsigned int lineBegin, unsigned int lineEnd, Store store) {
+    bool majorI;
+    float slope;
+    int offset;
+    unsigned int lines, line, m;
+    sweepGeometry(size, dirI, dirJ, &majorI, &slope, &offset, &lines);
+    const bool forward = (majorI ? dirI : dirJ) > 0.0f;
+    std::vector<int> shift(size);
+    std::vector<float> hullDistance(size), hullHeight(size);
+
+    for (m = 0; m < size; m++) {
+        shift[m] = (int) lroundf(m * slope);
+    }
+    for (line = lineBegin; line < lineEnd; line++) {
+        // The minor index moves monotonically along a line, so its samples inside the map are one run
+        int base = (int) line - offset;
+        const int *begin = &shift[0], *end = begin + size, *first, *last;
+        if (slope >= 0.0f) {
+            first = std::partition_point(begin, end, [base](int s) { return base + s < 0; });
+            last = std::partition_point(first, end, [base, size](int s) { return base + s < (int) size; });
+        } else {
+            first = std::partition_point(begin, end, [base, size](int s) { return base + s >= (int) size; });
+            last = std::partition_point(first, end, [base](int s) { return base + s >= 0; });
+        }
+        int top = 0;
+        for (m = first - begin; m < (unsigned int) (last - begin); m++) {
+            int minor = base + shift[m];
+            unsigned int major = forward ? m : size - 1 - m;
+            unsigned int i = majorI ? major : minor;
+            unsigned int j = majorI ? minor : major;
+            unsigned int k = i * size + j;
+            float distance = (i * dirI + j * dirJ) * spacing;
+            float height = heights[k];
+            while (top >= 2 && (hullHeight[top - 1] - hullHeight[top - 2]) * (distance - hullDistance[top - 2])
+                   <= (height - hullHeight[top - 2]) * (hullDistance[top - 1] - hullDistance[top - 2])) {
+                top--;
+            }
+            store(k, top > 0 ? (hullHeight[top - 1] - height) / (distance - hullDistance[top - 1]) : -HUGE_VALF);
+            hullDistance[top] = distance;
+            hullHeight[top] = height;
+            top++;
+        }
+    }
+}
+
+/* Adds the lines of a sweep to scheduler in batches of LIGHTING_LINES_PER_TASK. Every sample is
+ * stored once per sweep, so store needs no locking. */
+template<class Store>
+static void scheduleSweep(TaskScheduler &scheduler, const float *heights, unsigned int size, float spacing,
+                          float dirI, float dirJ, Store store) {
+    bool majorI;
+    float slope;
+    int offset;
+    unsigned int lines, begin;
+    sweepGeometry(size, dirI, dirJ, &majorI, &slope, &offset, &lines);
+    for (begin = 0; begin < lines; begin += LIGHTING_LINES_PER_TASK) {
+        unsigned int end = std::min(begin + LIGHTING_LINES_PER_TASK, lines);
+        scheduler.addTask([=]() {
+            horizonSweep(heights, size, spacing, dirI, dirJ, begin, end, store);
+        });
+    }
+}
+
+TerrainLighting::TerrainLighting()
+{
+    meshSize = 0;
+    sampleSpacing = 0.0f;
+    firstDirtyRow = 0;
+    endDirtyRow = 0;
+}
+
+void TerrainLighting::decodeHeights(const Heightfield &heights, std::vector<float> &out) const {
+    unsigned int i;
+    out.resize(meshSize * meshSize);
+    for (i = 0; i < meshSize; i++) {
+        heights.decodeRow(i, &out[i * meshSize]);
+    }
+}
+
+/* The occlusion of a sample is the mean sine of its horizon angles, the share of the sky a cosine
+ * weighted hemisphere would lose to them */
+void TerrainLighting::bake(const Heightfield &heights, float spacing, const QVector3D &lightDirection,
+                           TaskScheduler &scheduler) {
+    std::vector<float> map, occlusion;
+    std::vector<quint8> visibility;
+    unsigned int d, k;
+
+    meshSize = heights.size();
+    sampleSpacing = spacing;
+    decodeHeights(heights, map);
+    occlusion.assign(meshSize * meshSize, 0.0f);
+    float *occluded = occlusion.data();
+    // The lines of one direction run concurrently, the directions one after the other
+    for (d = 0; d < OCCLUSION_DIRECTIONS; d++) {
+        float angle = 2.0f * pi * d / OCCLUSION_DIRECTIONS;
+        scheduleSweep(scheduler, map.data(), meshSize, spacing, cosf(angle), sinf(angle),
+                      [occluded](unsigned int k, float tangent) {
+            if (tangent > 0.0f)
+                occluded[k] += tangent / sqrtf(1.0f + tangent * tangent);
+        });
+        scheduler.run();
+    }
+
+    visibility.resize(meshSize * meshSize);
+    sweepSun(map.data(), lightDirection, visibility.data(), scheduler);
+    rg.resize(2 * meshSize * meshSize);
+    for (k = 0; k < meshSize * meshSize; k++) {
+        rg[2 * k] = (quint8) (255.0f * (1.0f - occlusion[k] / OCCLUSION_DIRECTIONS) + 0.5f);
+        rg[2 * k + 1] = visibility[k];
+    }
+    bakedLight = lightDirection;
+    firstDirtyRow = 0;
+    endDirtyRow = meshSize;
+}
+
+void TerrainLighting::bakeSun(const Heightfield &heights, const QVector3D &lightDirection, TaskScheduler &scheduler) {
+    std::vector<float> map;
+    std::vector<quint8> visibility(meshSize * meshSize);
+    unsigned int i, j;
+
+    Q_ASSERT(heights.size() == meshSize);
+    decodeHeights(heights, map);
+    sweepSun(map.data(), lightDirection, visibility.data(), scheduler);
+    for (i = 0; i < meshSize; i++) {
+        quint8 *row = &rg[2 * i * meshSize];
+        const quint8 *sun = &visibility[i * meshSize];
+        bool changed = false;
+        for (j = 0; j < meshSize; j++) {
+            changed |= row[2 * j + 1] != sun[j];
+            row[2 * j + 1] = sun[j];
+        }
+        if (changed) {
+            firstDirtyRow = std::min(firstDirtyRow, i);
+            endDirtyRow = std::max(endDirtyRow, i + 1);
+        }
+    }
+    bakedLight = lightDirection;
+}
+
+/* A sample is lit when its horizon towards the sun is below the sun's elevation, with a linear
+ * ramp SUN_PENUMBRA_DEGREES wide around it */
+void TerrainLighting::sweepSun(const float *heights, const QVector3D &lightDirection, quint8 *visibility,
+                               TaskScheduler &scheduler) {
+    float horizontal = sqrtf(lightDirection.x() * lightDirection.x() + lightDirection.z() * lightDirection.z());
+    // Nothing casts a shadow on a sun straight overhead, and everything is in shadow of one straight below
+    if (horizontal < 1e-4f) {
+        memset(visibility, lightDirection.y() > 0.0f ? 255 : 0, meshSize * meshSize);
+        return;
+    }
+    float elevation = atan2f(lightDirection.y(), horizontal) * 180.0f / pi;
+    // Sweeping away from the sun makes the horizon behind each sample the one towards the sun
+    scheduleSweep(scheduler, heights, meshSize, sampleSpacing, -lightDirection.x() / horizontal,
+                  -lightDirection.z() / horizontal, [visibility, elevation](unsigned int k, float tangent) {
+        float lit = (elevation - atanf(tangent) * 180.0f / pi) / SUN_PENUMBRA_DEGREES + 0.5f;
+        visibility[k] = (quint8) (255.0f * std::max(0.0f, std::min(lit, 1.0f)) + 0.5f);
+    });
+    scheduler.run();
+}
+
+const quint8 *TerrainLighting::texels() const {
+    return rg.data();
+}
+
+unsigned int TerrainLighting::size() const {
+    return meshSize;
+}
+
+QVector3D TerrainLighting::lightDirection() const {
+    return bakedLight;
+}
+
+unsigned int TerrainLighting::dirtyBegin() const {
+    return firstDirtyRow;
+}
+
+unsigned int TerrainLighting::dirtyEnd() const {
+    return endDirtyRow;
+}
+
+void TerrainLighting::markClean() {
+    firstDirtyRow = meshSize;
+    endDirtyRow = 0;
+}
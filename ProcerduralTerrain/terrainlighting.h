@@ -0,0 +1,62 @@
+/****************************************************************************
+**
+Baked lighting of a finished terrain.
+Every height sample gets an 8 bit ambient occlusion and an 8 bit sun
+visibility term, stored interleaved as the texels of an RG8 texture with one
+row per row of the height map. Both terms come from horizon angles: the
+occlusion from the horizon in OCCLUSION_DIRECTIONS directions, the sun term
+from the horizon towards the sun. Horizons are found by sweeping parallel
+lines over the height map while keeping the upper convex hull of the samples
+passed so far, which costs O(1) per sample amortised. Lines are independent
+and are handed to the task scheduler in batches.
+**
+****************************************************************************/
+
+#ifndef TERRAINLIGHTING_H
+#define TERRAINLIGHTING_H
+
+#include <QVector3D>
+#include <QtGlobal>
+#include <vector>
+
+#include "heightfield.h"
+#include "taskscheduler.h"
+
+class TerrainLighting
+{
+public:
+    TerrainLighting();
+
+    /* Bakes both terms for heights, whose samples are spacing apart in x and z */
+    void bake(const Heightfield &heights, float spacing, const QVector3D &lightDirection, TaskScheduler &scheduler);
+    /* Re-bakes the sun term only, the occlusion does not depend on the light. Only rows whose
+     * texels changed are marked dirty. */
+    void bakeSun(const Heightfield &heights, const QVector3D &lightDirection, TaskScheduler &scheduler);
+
+    /* size() x size() pairs of occlusion and sun visibility, empty before the first bake */
+    const quint8 *texels() const;
+    unsigned int size() const;
+    /* The light direction the sun term was baked for */
+    QVector3D lightDirection() const;
+
+    /* Rows [dirtyBegin(), dirtyEnd()) changed since the last markClean() */
+    unsigned int dirtyBegin() const;
+    unsigned int dirtyEnd() const;
+    void markClean();
+
+private:
+    void decodeHeights(const Heightfield &heights, std::vector<float> &out) const;
+    void sweepSun(const float *heights, const QVector3D &lightDirection, quint8 *visibility, TaskScheduler &scheduler);
+
+    unsigned int meshSize;
+    float sampleSpacing;
+    QVector3D bakedLight;
+    std::vector<quint8> rg;
+    unsigned int firstDirtyRow, endDirtyRow;
+
+#define OCCLUSION_DIRECTIONS 8
+#define SUN_PENUMBRA_DEGREES 2.0f    // horizon angles this close to the sun's elevation are half lit
+#define LIGHTING_LINES_PER_TASK 64
+};
+
+#endif // TERRAINLIGHTING_H
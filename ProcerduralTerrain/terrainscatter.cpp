@@ -0,0 +1,131 @@
+/****************************************************************************
+**
+Scatters objects over the terrain with a parallel Poisson disk sampler.
+**
+****************************************************************************/
+
+#include "terrainscatter.h"
+
+#include <cfloat>
+#include <cmath>
+
+/* Integer hash used to give every tile and round its own random stream */
+static unsigned int hashInt(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+static float nextRandom(unsigned int &state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+TerrainScatter::TerrainScatter(const CollisionWorld &terrain, float minCoord, float maxCoord, float minHeight, float maxHeight)
+    : terrain(terrain)
+{
+    this->minCoord = minCoord;
+    this->maxCoord = maxCoord;
+    this->minHeight = minHeight;
+    this->maxHeight = maxHeight;
+    cellSize = 0.0f;
+    gridSize = 0;
+    tileCount = 0;
+}
+
+/* The grid is split into tiles of SCATTER_TILE_CELLS x SCATTER_TILE_CELLS cells, wide enough that a
+ * sample only ever looks at its own tile and the ring of tiles around it. Tiles are processed in four
+ * phases by (x, y) parity so tiles running at the same time never read or write each other's cells,
+ * which keeps the result identical for a given seed however the tiles are scheduled. Each task takes
+ * the tiles of one tile row of a phase. */
+std::vector<ScatterInstance> TerrainScatter::scatter(const ScatterParams &params, TaskScheduler &scheduler) {
+    int round, phase, i;
+    std::vector<ScatterInstance> instances;
+
+    cellSize = params.radius / sqrt(2.0f);
+    gridSize = (int) ceil((maxCoord - minCoord) / cellSize);
+    tileCount = (gridSize + SCATTER_TILE_CELLS - 1) / SCATTER_TILE_CELLS;
+    sampleX.assign(gridSize * gridSize, -FLT_MAX);
+    sampleZ.assign(gridSize * gridSize, 0.0f);
+
+    for (round = 0; round < SCATTER_ROUNDS; round++) {
+        for (phase = 0; phase < 4; phase++) {
+            for (i = phase / 2; i < tileCount; i += 2) {
+                scheduler.addTask([this, &params, round, phase, i]() {
+                    for (int j = phase % 2; j < tileCount; j += 2) {
+                        throwDarts(params, i * tileCount + j, round);
+                    }
+                });
+            }
+            scheduler.run();
+        }
+    }
+
+    for (i = 0; i < gridSize * gridSize; i++) {
+        if (sampleX[i] == -FLT_MAX)
+            continue;
+        unsigned int state = hashInt(params.seed ^ hashInt(i)) | 1;
+        ScatterInstance instance;
+        instance.x = sampleX[i];
+        instance.z = sampleZ[i];
+        instance.y = terrain.terrainHeight(instance.x, instance.z);
+        instance.scale = params.minScale + nextRandom(state) * (params.maxScale - params.minScale);
+        instance.yaw = 360.0f * nextRandom(state);
+        instances.push_back(instance);
+    }
+    return instances;
+}
+
+/* Height band and slope filter, the slope is that of the triangle the object stands on */
+bool TerrainScatter::accept(const ScatterParams &params, float x, float z) const {
+    float height = terrain.terrainHeight(x, z);
+    float coefficient = (height - minHeight) / (maxHeight - minHeight);
+    if (coefficient < params.minBand || coefficient > params.maxBand)
+        return false;
+    return terrain.terrainNormal(x, z).y() >= params.minNormalY;
+}
+
+void TerrainScatter::throwDarts(const ScatterParams &params, int tile, int round) {
+    int tileX = tile / tileCount;
+    int tileY = tile % tileCount;
+    int darts = SCATTER_DARTS_PER_CELL * SCATTER_TILE_CELLS * SCATTER_TILE_CELLS;
+    float radius2 = params.radius * params.radius;
+    unsigned int state = hashInt(params.seed ^ hashInt(tile * SCATTER_ROUNDS + round)) | 1;
+
+    for (int d = 0; d < darts; d++) {
+        int cellX = tileX * SCATTER_TILE_CELLS + (int) (nextRandom(state) * SCATTER_TILE_CELLS);
+        int cellY = tileY * SCATTER_TILE_CELLS + (int) (nextRandom(state) * SCATTER_TILE_CELLS);
+        float x = minCoord + (cellX + nextRandom(state)) * cellSize;
+        float z = minCoord + (cellY + nextRandom(state)) * cellSize;
+        if (cellX >= gridSize || cellY >= gridSize || x > maxCoord || z > maxCoord)
+            continue;
+        if (sampleX[cellX * gridSize + cellY] != -FLT_MAX)
+            continue;
+
+        // Cells are radius/sqrt(2) wide, so conflicts can only be up to two cells away
+        bool free = true;
+        for (int u = std::max(0, cellX - 2); free && u <= std::min(gridSize - 1, cellX + 2); u++) {
+            for (int v = std::max(0, cellY - 2); v <= std::min(gridSize - 1, cellY + 2); v++) {
+                float sx = sampleX[u * gridSize + v];
+                if (sx == -FLT_MAX)
+                    continue;
+                float ex = sx - x;
+                float ez = sampleZ[u * gridSize + v] - z;
+                if (ex * ex + ez * ez < radius2) {
+                    free = false;
+                    break;
+                }
+            }
+        }
+        if (!free || !accept(params, x, z))
+            continue;
+
+        sampleX[cellX * gridSize + cellY] = x;
+        sampleZ[cellX * gridSize + cellY] = z;
+    }
+}
@@ -0,0 +1,59 @@
+/****************************************************************************
+**
+Scatters objects over the terrain with a parallel Poisson disk sampler.
+Samples are filtered by height band and slope and returned as per-instance
+transforms ready to be uploaded for an instanced draw.
+**
+****************************************************************************/
+
+#ifndef TERRAINSCATTER_H
+#define TERRAINSCATTER_H
+
+#include <vector>
+
+#include "collisionworld.h"
+#include "taskscheduler.h"
+
+/* Layout of one instance in the instance buffer */
+struct ScatterInstance {
+    float x, y, z;
+    float scale;
+    float yaw;
+};
+
+struct ScatterParams {
+    float radius;               // minimum distance between two objects
+    float minBand, maxBand;     // accepted (height - minHeight)/(maxHeight - minHeight)
+    float minNormalY;           // flattest is 1, so larger values reject steeper ground
+    float minScale, maxScale;
+    unsigned int seed;
+};
+
+class TerrainScatter
+{
+public:
+    TerrainScatter(const CollisionWorld &terrain, float minCoord, float maxCoord, float minHeight, float maxHeight);
+
+    /* Runs the tiles on scheduler, which must not be running anything else */
+    std::vector<ScatterInstance> scatter(const ScatterParams &params, TaskScheduler &scheduler);
+
+private:
+    bool accept(const ScatterParams &params, float x, float z) const;
+    void throwDarts(const ScatterParams &params, int tile, int round);
+
+    const CollisionWorld &terrain;
+    float minCoord, maxCoord;
+    float minHeight, maxHeight;
+
+    /* Background grid of the sampler. Cells are small enough to hold at most one sample,
+     * empty cells have sampleX set to -FLT_MAX. */
+    float cellSize;
+    int gridSize, tileCount;
+    std::vector<float> sampleX, sampleZ;
+
+#define SCATTER_TILE_CELLS 2
+#define SCATTER_DARTS_PER_CELL 4
+#define SCATTER_ROUNDS 3
+};
+
+#endif // TERRAINSCATTER_H
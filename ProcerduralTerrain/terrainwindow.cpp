@@ -9,20 +9,25 @@ author: Zheng Xu, xuzhustc@gmail.com
 
 #include "terrainwindow.h"
 
+#include <QtConcurrent>
+
 TerrainWindow::TerrainWindow(QWidget *parent)
     : QOpenGLWidget(parent)
 {
     memset(textures, 0, sizeof(textures));
     txtPath = TXT_IMG_PATH;
-    horizontalAngle = 90.0f;
-    verticalAngle = 0.0f;
+    camera.position = QVector3D();
+    camera.horizontalAngle = 90.0f;
+    camera.verticalAngle = 0.0f;
+    previousCamera = camera;
     turningSpeed = 1.5f;
     movementSpeed = 0.005f;
-    position = new QVector3D();
-    automoveTimer = new QTimer(this);
+    automoving = false;
+    somersaulting = false;
     automoveInterval = 300;
-    somersaultTimer = new QTimer(this);
-    lightDirection = QVector3D(0.0f, 1.0f, 0.0f);
+    lastFrameTime = 0;
+    simulationLag = 0;
+    lightDirection = QVector3D(0.7f, 0.6f, 0.4f);  // sun about 37 degrees up
     lightDirection.normalize();
     lightIntensity = QVector3D(1.0f, 1.0f, 1.0f);
     meshSize = 1 + pow(2, 10);
@@ -30,24 +35,62 @@ TerrainWindow::TerrainWindow(QWidget *parent)
     maxCoord = 1.0f;
     minHeight = FLT_MAX;
     maxHeight = -FLT_MAX;
-    connect(automoveTimer, SIGNAL(timeout()), this, SLOT(automove()));
-    connect(somersaultTimer, SIGNAL(timeout()), this, SLOT(somersault()));
+    program = NULL;
+    scatterProgram = NULL;
+    scatterCount = 0;
+    pipelinedBuild = true;
+    progressiveBuild = true;
+    heightStorage = Heightfield::Float32;
+    normalStorage = PackedNormals::Float32;
+    terrainReady = false;
+    meshStride = 1;
+    vertexCount = 0;
+    terrainSeed = time(NULL);
+    lightmapTexture = 0;
+    lightmapSize = 0;
+    lightBaking = false;
+    memset(&renderStats, 0, sizeof(renderStats));
+    memset(&buildStats, 0, sizeof(buildStats));
+    frameClock.start();
+    connect(this, SIGNAL(frameSwapped()), this, SLOT(nextFrame()));
 }
 
 TerrainWindow::~TerrainWindow()
 {
+    refineFuture.waitForFinished();
+    bakeFuture.waitForFinished();
     makeCurrent();
+    releaseGL();
+    doneCurrent();
+}
+
+/* Frees the GL objects, needs the context they were created in to be current */
+void TerrainWindow::releaseGL()
+{
     vbo.destroy();
+    scatterMeshVbo.destroy();
+    scatterInstanceVbo.destroy();
+    vao.destroy();
+    scatterVao.destroy();
+    if (lightmapTexture != 0)
+        glDeleteTextures(1, &lightmapTexture);
+    lightmapTexture = 0;
     delete program;
-    for (int j = 0; j < 6; ++j)
+    delete scatterProgram;
+    program = NULL;
+    scatterProgram = NULL;
+    for (int j = 0; j < 6; ++j) {
         delete textures[j];
-    doneCurrent();
+        textures[j] = NULL;
+    }
 }
 
 void TerrainWindow::initializeGL()
 {
-    unsigned int i;
     initializeOpenGLFunctions();
+    // Not context(), which is only set once the widget is shown and TerrainBenchmark runs without it
+    gl33 = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_3_Core>();
+    gl33->initializeOpenGLFunctions();
 
     setFocusPolicy(Qt::TabFocus);
 
@@ -64,52 +107,334 @@ void TerrainWindow::initializeGL()
     clearColor.setRgbF(0.1, 0.1, 0.1, 1.0);
 
     vao.create(); vao.bind();
+    initLightmap();
+
+    hmap = buildArena.allocateRows<float>(meshSize, meshSize);
+    rawHmap = buildArena.allocateRows<float>(meshSize, meshSize);
+
+    buildTimer.start();
+    if (progressiveBuild) {
+        // Only the first few diamond-square levels, the rest is refined by refineTerrain
+        std::vector<MeshTile> tiles(1);
+        generateTerrain(PREVIEW_STRIDE);
+        addCoarseHeightMap(tiles[0], PREVIEW_STRIDE);
+        uploadTiles(tiles);
+        meshStride = PREVIEW_STRIDE;
+    } else {
+        if (pipelinedBuild) {
+            std::vector<MeshTile> tiles;
+            buildStats.firstBandTime = buildTerrainPipelined(buildTimer, tiles, true);
+            uploadTiles(tiles);
+        } else {
+            generateTerrain();
+            smoothTerrain();
+            addHeightMap();
+            buildStats.firstBandTime = buildTimer.elapsed();
+        }
+        buildStats.meshTime = buildTimer.elapsed();
+    }
 
-    hmap = new float*[meshSize];
-    for (i = 0; i < meshSize; i++) {
-        hmap[i] = new float[meshSize];
+    initMat();
+    initShaders();
+    if (progressiveBuild) {
+        refineFuture = QtConcurrent::run(this, &TerrainWindow::refineTerrain);
+    } else {
+        storeTerrain();
+        scatterObjects(collisionWorld);
+        releaseBuild();
+        terrainReady = true;
+        bakeLighting(lightDirection, false);
+        uploadLightmap();
+        initScatter();
     }
+}
 
+void TerrainWindow::setPipelinedBuild(bool pipelined) {
+    pipelinedBuild = pipelined;
+}
 
+void TerrainWindow::setProgressiveBuild(bool progressive) {
+    progressiveBuild = progressive;
+}
 
-    dsFractal(.2f, .2f, .3f, .2f, 4.0f);
-    smoothTerrain();
-    addHeightMap(hmap);
-    initMat();
-    initShaders();
+void TerrainWindow::setTerrainSeed(unsigned int seed) {
+    terrainSeed = seed;
 }
 
-void TerrainWindow::smoothTerrain() {
-    int i, j, u, v;
-    int filterLocX, filterLocY;
-    int filterSize = 5;
-    float newValue;
-    float **filter = new float*[filterSize];
-    for (i = 0; i < filterSize; i++) {
-        filter[i] = new float[filterSize];
-        for (j = 0; j < filterSize; j++) {
-            filter[i][j] = 1.0f / (filterSize * filterSize);
-        }
+void TerrainWindow::generateTerrain(unsigned int stride) {
+    dsFractal(.2f, .2f, .3f, .2f, 4.0f, stride);
+}
+
+/* Background half of the progressive build. Publishes a mesh every two diamond-square levels, then
+ * finishes the levels and builds the full resolution terrain, its resident storage and its objects,
+ * so that publishing it is left with the uploads. The GUI thread does not touch hmap, the resident
+ * terrain or publishedWorld until the full resolution mesh has been published. */
+void TerrainWindow::refineTerrain() {
+    unsigned int stride;
+    for (stride = PREVIEW_STRIDE / 4; stride > 1; stride /= 4) {
+        std::vector<MeshTile> tiles(1);
+        refineFractal(stride);
+        addCoarseHeightMap(tiles[0], stride);
+        queuePublish(tiles, stride);
     }
 
-    for (i = 0 ; i < meshSize; i++) {
-        for (j = 0; j < meshSize; j++) {
-            newValue = 0.0;
+    std::vector<MeshTile> tiles;
+    refineFractal(1);
+    if (pipelinedBuild) {
+        buildTerrainPipelined(buildTimer, tiles, false);
+    } else {
+        tiles.resize(1);
+        smoothTerrain();
+        calculateNormals();
+        addHeightMapRows(tiles[0], 0, meshSize - 1);
+    }
+    storeTerrain();
+    scatterObjects(publishedWorld);
+    queuePublish(tiles, 1);
+}
 
-            for (u = 0; u < filterSize; u++) {
-                filterLocX = (i - ((filterSize - 1) / 2) + u);
-                filterLocX = std::max(0, std::min(filterLocX, (int) meshSize - 1));
+/* Called from the refining thread, hands the mesh over to publishTerrain on the GUI thread */
+void TerrainWindow::queuePublish(std::vector<MeshTile> &tiles, unsigned int stride) {
+    {
+        QMutexLocker locker(&publishLock);
+        publishedTiles.swap(tiles);
+        publishedStride = stride;
+    }
+    QMetaObject::invokeMethod(this, "publishTerrain", Qt::QueuedConnection);
+}
 
-                for (v = 0; v < filterSize; v++) {
-                    filterLocY = (j - ((filterSize - 1) / 2) + v);
-                    filterLocY = std::max(0, std::min(filterLocY, (int) meshSize - 1));
-                    newValue += filter[u][v] * hmap[filterLocX][filterLocY];
-                }
-            }
+void TerrainWindow::publishTerrain() {
+    std::vector<MeshTile> tiles;
+    unsigned int stride;
+    {
+        QMutexLocker locker(&publishLock);
+        tiles.swap(publishedTiles);
+        stride = publishedStride;
+    }
+    // A later publish already picked up the data
+    if (tiles.empty())
+        return;
 
-            hmap[i][j] = newValue;
-        }
+    makeCurrent();
+    uploadTiles(tiles);
+    meshStride = stride;
+    if (stride == 1) {
+        releaseBuild();
+        collisionWorld.swap(publishedWorld);
+        terrainReady = true;
+        // The camera still stands on the preview, put it on the finished surface
+        camera.position.setY(collisionWorld.terrainHeight(camera.position.x(), camera.position.z()));
+        previousCamera = camera;
+        // The scatter ran on refineTerrain before the publish, so scheduler is free for the bake
+        initScatter();
+        startLightBake();
     }
+    doneCurrent();
+    update();
+}
+
+void TerrainWindow::setTerrainStorage(Heightfield::Mode heights, PackedNormals::Mode normals) {
+    heightStorage = heights;
+    normalStorage = normals;
+}
+
+/* Encodes the finished heights and face normals into their resident storage. From here on the
+ * terrain is only read through terrainHeights and terrainNormals. */
+void TerrainWindow::storeTerrain() {
+    unsigned int meshTriangleSize = (meshSize - 1) * 2;
+
+    terrainHeights.encode(hmap, meshSize, heightStorage);
+    terrainNormals.encode(normals, meshSize - 1, meshTriangleSize, normalStorage);
+    buildStats.residentBytes = terrainHeights.bytes() + terrainNormals.bytes();
+    buildStats.maxHeightError = terrainHeights.maxError();
+}
+
+/* Frees the build buffers once the terrain is stored and its mesh tiles are uploaded */
+void TerrainWindow::releaseBuild() {
+    buildStats.arenaAllocations = buildArena.allocationCount();
+    buildStats.arenaBytes = buildArena.bytesAllocated();
+    buildStats.arenaChunks = buildArena.chunkCount();
+    // The maps, normals and mesh tiles of the build all go at once
+    buildArena.release();
+    hmap = rawHmap = NULL;
+    normals = NULL;
+}
+
+/* Scatters rocks over the stored terrain and gives each a box in world, which gets the terrain as
+ * well. Needs no GL, initScatter uploads scatterInstances afterwards. */
+void TerrainWindow::scatterObjects(CollisionWorld &world) {
+    unsigned int i;
+
+    world.setTerrain(&terrainHeights, &terrainNormals, minCoord, maxCoord);
+    ScatterParams params;
+    params.radius = 0.006f;
+    params.minBand = LOW_MID_CUTOFF;
+    params.maxBand = MID_HIGH_CUTOFF;
+    params.minNormalY = 0.5f;
+    params.minScale = 0.002f;
+    params.maxScale = 0.006f;
+    params.seed = fractalRng();
+    TerrainScatter scatter(world, minCoord, maxCoord, minHeight, maxHeight);
+    scatterInstances = scatter.scatter(params, scheduler);
+
+    for (i = 0; i < scatterInstances.size(); i++) {
+        const ScatterInstance &instance = scatterInstances[i];
+        float halfWidth = 0.5f * 1.415f * instance.scale; // covers any yaw
+        world.addBox(QVector3D(instance.x - halfWidth, instance.y, instance.z - halfWidth),
+                     QVector3D(instance.x + halfWidth, instance.y + instance.scale, instance.z + halfWidth));
+    }
+}
+
+/* Until the first bake the lightmap is a single texel without occlusion, in full sun */
+void TerrainWindow::initLightmap() {
+    static const quint8 unshaded[2] = { 255, 255 };
+    glGenTextures(1, &lightmapTexture);
+    glBindTexture(GL_TEXTURE_2D, lightmapTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, 1, 1, 0, GL_RG, GL_UNSIGNED_BYTE, unshaded);
+    lightmapSize = 1;
+}
+
+/* Bakes occlusion and sun the first time, only the sun for direction after that. With publish the
+ * result goes to publishLighting on the GUI thread, as bakes started by startLightBake run on
+ * bakeFuture. Uses scheduler, which is idle once the terrain is built. */
+void TerrainWindow::bakeLighting(QVector3D direction, bool publish) {
+    QElapsedTimer timer;
+    timer.start();
+    if (terrainLighting.size() == 0) {
+        terrainLighting.bake(terrainHeights, (maxCoord - minCoord) / (float) meshSize, direction, scheduler);
+    } else {
+        terrainLighting.bakeSun(terrainHeights, direction, scheduler);
+    }
+    buildStats.bakeTime = timer.elapsed();
+    buildStats.bakeRows = std::max(0, (int) terrainLighting.dirtyEnd() - (int) terrainLighting.dirtyBegin());
+    if (publish)
+        QMetaObject::invokeMethod(this, "publishLighting", Qt::QueuedConnection);
+}
+
+/* Bakes for the current lightDirection in the background. While a bake is running this does
+ * nothing, publishLighting starts another one if the light has moved since. */
+void TerrainWindow::startLightBake() {
+    if (lightBaking)
+        return;
+    lightBaking = true;
+    bakeFuture = QtConcurrent::run(this, &TerrainWindow::bakeLighting, lightDirection, true);
+}
+
+void TerrainWindow::publishLighting() {
+    makeCurrent();
+    uploadLightmap();
+    doneCurrent();
+    lightBaking = false;
+    if (terrainLighting.lightDirection() != lightDirection)
+        startLightBake();
+    update();
+}
+
+/* Uploads the rows the last bake changed, all of them the first time */
+void TerrainWindow::uploadLightmap() {
+    unsigned int size = terrainLighting.size();
+    unsigned int begin = terrainLighting.dirtyBegin();
+    unsigned int end = terrainLighting.dirtyEnd();
+    if (begin >= end)
+        return;
+    glBindTexture(GL_TEXTURE_2D, lightmapTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);  // rows are 2 * size bytes
+    if (lightmapSize != size) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, size, size, 0, GL_RG, GL_UNSIGNED_BYTE, terrainLighting.texels());
+        lightmapSize = size;
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, begin, size, end - begin, GL_RG, GL_UNSIGNED_BYTE,
+                        terrainLighting.texels() + 2 * begin * size);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    renderStats.uploadBytes += 2 * (end - begin) * size;
+    terrainLighting.markClean();
+}
+
+void TerrainWindow::uploadTiles(const std::vector<MeshTile> &tiles) {
+    unsigned int t;
+    int offset = 0;
+    int size = 0;
+    for (t = 0; t < tiles.size(); t++) {
+        size += tiles[t].floatCount * sizeof(GLfloat);
+    }
+    if (!vbo.isCreated())
+        vbo.create();
+    vbo.bind();
+    vbo.allocate(size);
+    for (t = 0; t < tiles.size(); t++) {
+        vbo.write(offset, tiles[t].vertices, tiles[t].floatCount * sizeof(GLfloat));
+        offset += tiles[t].floatCount * sizeof(GLfloat);
+    }
+    vertexCount = size / (10 * sizeof(GLfloat));
+    renderStats.uploadBytes += size;
+}
+
+/* Runs generate -> smooth -> normals -> mesh as a task graph over bands of TILE_ROWS cell rows, so
+ * that e.g. band A is smoothed while band B gets its normals and band C is meshed.
+ * Smoothing band t also needs the first row of band t+1 before its normals can be computed, and
+ * the vertex normals of band t read the last face normal row of band t-1 and the first of band t+1.
+ * Returns the time the first band was meshed. The bands are only uploaded once all are done. */
+qint64 TerrainWindow::buildTerrainPipelined(const QElapsedTimer &timer, std::vector<MeshTile> &tileData, bool generate) {
+    unsigned int t;
+    unsigned int cellRows = meshSize - 1;
+    unsigned int tiles = (cellRows + TILE_ROWS - 1) / TILE_ROWS;
+    std::vector<int> smoothTasks(tiles), normalTasks(tiles), meshTasks(tiles);
+    std::atomic<qint64> firstTileTime(-1);
+
+    tileData.resize(tiles);
+    allocateNormals();
+    // With generate false the heights are already complete and the task only swaps the maps
+    int generateTask = scheduler.addTask([this, generate]() {
+        if (generate)
+            generateTerrain();
+        std::swap(hmap, rawHmap); // smoothing reads the raw heights and writes hmap
+    });
+
+    for (t = 0; t < tiles; t++) {
+        unsigned int begin = t * TILE_ROWS;
+        unsigned int end = std::min(begin + TILE_ROWS, cellRows);
+        unsigned int smoothEnd = (t == tiles - 1) ? meshSize : end;
+        MeshTile *data = &tileData[t];
+
+        smoothTasks[t] = scheduler.addTask([this, begin, smoothEnd]() {
+            smoothRows(begin, smoothEnd);
+        });
+        normalTasks[t] = scheduler.addTask([this, begin, end]() {
+            calculateNormalRows(begin, end);
+        });
+        meshTasks[t] = scheduler.addTask([this, begin, end, data, &timer, &firstTileTime]() {
+            addHeightMapRows(*data, begin, end);
+            qint64 unset = -1;
+            firstTileTime.compare_exchange_strong(unset, timer.elapsed());
+        });
+        scheduler.addDependency(smoothTasks[t], generateTask);
+        scheduler.addDependency(normalTasks[t], smoothTasks[t]);
+        scheduler.addDependency(meshTasks[t], normalTasks[t]);
+    }
+    for (t = 0; t < tiles; t++) {
+        if (t + 1 < tiles)
+            scheduler.addDependency(normalTasks[t], smoothTasks[t + 1]);
+        if (t > 0)
+            scheduler.addDependency(meshTasks[t], normalTasks[t - 1]);
+        if (t + 1 < tiles)
+            scheduler.addDependency(meshTasks[t], normalTasks[t + 1]);
+    }
+    scheduler.run();
+    return firstTileTime;
+}
+
+/* Box filters the raw heights into hmap. Reads and writes go to different maps, so any set of
+ * row ranges can be smoothed concurrently. */
+void TerrainWindow::smoothTerrain() {
+    std::swap(hmap, rawHmap);
+    smoothRows(0, meshSize);
+}
+
+void TerrainWindow::smoothRows(unsigned int begin, unsigned int end) {
+    TerrainKernels::boxFilter(rawHmap, hmap, meshSize, SMOOTH_RADIUS, begin, end);
 }
 
 void TerrainWindow::initMat()
@@ -119,15 +444,99 @@ void TerrainWindow::initMat()
     proj.perspective(55.0f, 1.0f, 0.000001f, 100.0f);
     view.lookAt(QVector3D(0.0f, 0.0, 0.0f), QVector3D(0.0f, 0.0f, 1.0f), QVector3D(0.0f, 1.0f, 0.0f));
     mvpMat0 = proj * view;
-    mvpMat = mvpMat0;
-    int xHeightMapCoord = round(((position -> x() - minCoord) * (float) meshSize)/(maxCoord-minCoord));
-    int yHeightMapCoord = round(((position -> z() - minCoord) * (float) meshSize)/(maxCoord-minCoord));
-    //  position->setY()
-    position->setY(hmap[xHeightMapCoord][yHeightMapCoord]);
-    mvpMat.translate(0.0f, -position->y() - .01f, 0.0f);
-    //mvpMat.rotate(20.0f, 0.0f, 1.0f, 0.0f);
+    int xHeightMapCoord = round(((camera.position.x() - minCoord) * (float) meshSize)/(maxCoord-minCoord));
+    int yHeightMapCoord = round(((camera.position.z() - minCoord) * (float) meshSize)/(maxCoord-minCoord));
+    // Snap to a sample that exists in the mesh generated so far
+    xHeightMapCoord = meshStride * round(xHeightMapCoord / (float) meshStride);
+    yHeightMapCoord = meshStride * round(yHeightMapCoord / (float) meshStride);
+    camera.position.setY(hmap[xHeightMapCoord][yHeightMapCoord]);
+    previousCamera = camera;
+    mvpMat = cameraMatrix(camera);
+}
+
+/* The view of a camera standing at state.position, looking along horizontalAngle and pitched
+ * by verticalAngle around the point below the eye. Built from scratch every frame, so no error
+ * builds up however long the camera moves. */
+QMatrix4x4 TerrainWindow::cameraMatrix(const CameraState &state) {
+    QMatrix4x4 matrix = mvpMat0;
+    matrix.translate(0.0f, -EYE_HEIGHT, 0.0f);
+    matrix.rotate(-state.verticalAngle, 1.0f, 0.0f, 0.0f);
+    matrix.rotate(state.horizontalAngle - 90.0f, 0.0f, 1.0f, 0.0f);
+    matrix.translate(-state.position);
+    return matrix;
+}
+
+/* Difference b - a of two angles in degrees, taken the short way round */
+static float angleDifference(float a, float b) {
+    float difference = fmod(b - a, 360.0f);
+    if (difference > 180.0f)
+        difference -= 360.0f;
+    else if (difference < -180.0f)
+        difference += 360.0f;
+    return difference;
+}
+
+/* Where the camera is shown, alpha of the way from the previous simulation step to the current one */
+CameraState TerrainWindow::interpolateCamera(float alpha) {
+    CameraState state;
+    state.position = previousCamera.position + alpha * (camera.position - previousCamera.position);
+    state.horizontalAngle = previousCamera.horizontalAngle
+            + alpha * angleDifference(previousCamera.horizontalAngle, camera.horizontalAngle);
+    state.verticalAngle = previousCamera.verticalAngle
+            + alpha * angleDifference(previousCamera.verticalAngle, camera.verticalAngle);
+    return state;
+}
+
+/* Runs as many fixed SIMULATION_STEP_MS steps as the time since the last frame covers. After a
+ * long stall at most MAX_SIMULATION_STEPS run and the rest of the time is dropped, so a slow frame
+ * is not followed by an even slower one. Returns how far into the next step the frame is. */
+float TerrainWindow::advanceSimulation() {
+    const qint64 step = SIMULATION_STEP_MS * 1000000LL;
+    qint64 now = frameClock.nsecsElapsed();
+    simulationLag += now - lastFrameTime;
+    lastFrameTime = now;
+    if (!automoving && !somersaulting) {
+        simulationLag = 0;
+        previousCamera = camera;
+        return 0.0f;
+    }
+
+    simulationLag = std::min(simulationLag, MAX_SIMULATION_STEPS * step);
+    while (simulationLag >= step) {
+        previousCamera = camera;
+        stepSimulation();
+        simulationLag -= step;
+    }
+    return simulationLag / (float) step;
+}
+
+/* One fixed step: automove covers AUTOMOVE_DISTANCE every automoveInterval ms and the somersault
+ * turns turningSpeed every SOMERSAULT_INTERVAL_MS ms, the rates the old timers ran at */
+void TerrainWindow::stepSimulation() {
+    if (automoving)
+        moveCameraForward(AUTOMOVE_DISTANCE * SIMULATION_STEP_MS / automoveInterval);
+    if (somersaulting) {
+        camera.verticalAngle += turningSpeed * SIMULATION_STEP_MS / SOMERSAULT_INTERVAL_MS;
+        if (camera.verticalAngle >= 360.0f) {
+            camera.verticalAngle = 0.0f; // Stop after one full rotation
+            somersaulting = false;
+        }
+    }
+}
 
+/* Starts the frame loop if an animation was off, the clock restarts so the idle time is not simulated */
+void TerrainWindow::startAnimation() {
+    if (!automoving && !somersaulting) {
+        lastFrameTime = frameClock.nsecsElapsed();
+        simulationLag = 0;
+    }
+}
 
+/* Each frame asks for the next one once it has been swapped, so while animating frames come at the
+ * display's refresh rate */
+void TerrainWindow::nextFrame() {
+    if (automoving || somersaulting)
+        update();
 }
 
 void TerrainWindow::initShaders()
@@ -145,12 +554,18 @@ void TerrainWindow::initShaders()
             "uniform mat4 matrix;\n"
             "uniform vec3 lightIntensity;\n"
             "uniform vec3 lightDirection;\n"
+            "uniform float ambientLight;\n"
+            "uniform sampler2D lightmap;\n"
+            "uniform float lightmapOrigin;\n"
+            "uniform float lightmapSpacing;\n"
             "out vec4 clr;\n"
             "out vec3 norm;\n"
             "void main(void)\n"
             "{\n"
-            "   vec4 n = normalize(matrix * vec4(normal, 0.0));\n"
-            "   clr = vec4(lightIntensity, 1.0) * color * max( dot( vec4(lightDirection, 0.0), n ), 0.0);\n"
+            "   ivec2 texel = ivec2(round((vertex.zx - lightmapOrigin) / lightmapSpacing));\n"
+            "   vec2 baked = texelFetch(lightmap, clamp(texel, ivec2(0), textureSize(lightmap, 0) - 1), 0).rg;\n"
+            "   float sun = max( dot( lightDirection, normalize(normal) ), 0.0) * baked.g;\n"
+            "   clr = vec4(lightIntensity * (ambientLight * baked.r + (1.0 - ambientLight) * sun), 1.0) * color;\n"
             "   norm = normal;\n"
             "   gl_Position = matrix * vertex;\n"
             "}\n";
@@ -178,33 +593,149 @@ void TerrainWindow::initShaders()
     program->link();
 
     program->bind();
-    program->setUniformValue("fTexture", 0);
+    // Lightmap texel (j, i) belongs to the height sample at x = origin + i * spacing, z = origin + j * spacing
+    program->setUniformValue("lightmap", 0);
+    program->setUniformValue("lightmapOrigin", minCoord);
+    program->setUniformValue("lightmapSpacing", (maxCoord - minCoord) / (float) meshSize);
+    program->setUniformValue("ambientLight", AMBIENT_LIGHT);
 
 }
 
-void TerrainWindow::addHeightMapVertex(QVector<GLfloat> &vertData, QVector3D &position, QVector3D &normal, QVector4D &color) {
+/* Uploads the rocks scatterObjects placed over the grey band of the terrain as one instance buffer */
+void TerrainWindow::initScatter()
+{
+#define SCATTER_VERTEX_ATTRIBUTE 0
+#define SCATTER_NORMAL_ATTRIBUTE 1
+#define SCATTER_OFFSET_ATTRIBUTE 3
+#define SCATTER_YAW_ATTRIBUTE 4
+    int face, corner;
+    std::vector<ScatterInstance> instances;
+
+    instances.swap(scatterInstances);
+    scatterCount = instances.size();
+
+    /* Unit cube sitting on the origin, position and normal per vertex */
+    static const float cubeNormals[6][3] = {
+        { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }
+    };
+    static const int triangleCorners[6] = { 0, 1, 2, 0, 2, 3 };
+    QVector<GLfloat> meshData;
+    for (face = 0; face < 6; face++) {
+        QVector3D n(cubeNormals[face][0], cubeNormals[face][1], cubeNormals[face][2]);
+        QVector3D u(n.y(), n.z(), n.x());
+        QVector3D v = QVector3D::crossProduct(n, u);
+        for (corner = 0; corner < 6; corner++) {
+            int c = triangleCorners[corner];
+            QVector3D p = 0.5f * n + ((c == 1 || c == 2) ? 0.5f : -0.5f) * u + ((c >= 2) ? 0.5f : -0.5f) * v;
+            meshData.append(p.x());
+            meshData.append(p.y() + 0.5f);
+            meshData.append(p.z());
+            meshData.append(n.x());
+            meshData.append(n.y());
+            meshData.append(n.z());
+        }
+    }
+
+    QOpenGLShader *vshader = new QOpenGLShader(QOpenGLShader::Vertex, this);
+    const char *vsrc =
+            "#version 330\n"
+            "layout (location = 0) in vec3 vertex;\n"
+            "layout (location = 1) in vec3 normal;\n"
+            "layout (location = 3) in vec4 offset;\n"
+            "layout (location = 4) in float yaw;\n"
+            "uniform mat4 matrix;\n"
+            "uniform vec3 lightIntensity;\n"
+            "uniform vec3 lightDirection;\n"
+            "uniform vec4 color;\n"
+            "uniform float ambientLight;\n"
+            "out vec4 clr;\n"
+            "void main(void)\n"
+            "{\n"
+            "   float s = sin(radians(yaw));\n"
+            "   float c = cos(radians(yaw));\n"
+            "   mat3 rot = mat3(c, 0.0, -s, 0.0, 1.0, 0.0, s, 0.0, c);\n"
+            "   float sun = max( dot( lightDirection, rot * normal ), 0.0);\n"
+            "   clr = vec4(lightIntensity * (ambientLight + (1.0 - ambientLight) * sun), 1.0) * color;\n"
+            "   gl_Position = matrix * vec4(offset.xyz + offset.w * (rot * vertex), 1.0);\n"
+            "}\n";
+    vshader->compileSourceCode(vsrc);
+
+    QOpenGLShader *fshader = new QOpenGLShader(QOpenGLShader::Fragment, this);
+    const char *fsrc =
+            "#version 330\n"
+            "in vec4 clr;\n"
+            "out vec4 ffColor;\n"
+            "void main(void)\n"
+            "{\n"
+            "       ffColor = clr;\n"
+            "}\n";
+    fshader->compileSourceCode(fsrc);
+
+    scatterProgram = new QOpenGLShaderProgram;
+    scatterProgram->addShader(vshader);
+    scatterProgram->addShader(fshader);
+    scatterProgram->link();
+    scatterProgram->bind();
+    scatterProgram->setUniformValue("ambientLight", AMBIENT_LIGHT);
+
+    scatterVao.create(); scatterVao.bind();
+    scatterMeshVbo.create();
+    scatterMeshVbo.bind();
+    scatterMeshVbo.allocate(meshData.constData(), meshData.count() * sizeof(GLfloat));
+    scatterProgram->enableAttributeArray(SCATTER_VERTEX_ATTRIBUTE);
+    scatterProgram->setAttributeBuffer(SCATTER_VERTEX_ATTRIBUTE, GL_FLOAT, 0, 3, 6 * sizeof(GLfloat));
+    scatterProgram->enableAttributeArray(SCATTER_NORMAL_ATTRIBUTE);
+    scatterProgram->setAttributeBuffer(SCATTER_NORMAL_ATTRIBUTE, GL_FLOAT, 3 * sizeof(GLfloat), 3, 6 * sizeof(GLfloat));
+
+    scatterInstanceVbo.create();
+    scatterInstanceVbo.bind();
+    scatterInstanceVbo.allocate(instances.data(), instances.size() * sizeof(ScatterInstance));
+    renderStats.uploadBytes += meshData.count() * sizeof(GLfloat) + instances.size() * sizeof(ScatterInstance);
+    scatterProgram->enableAttributeArray(SCATTER_OFFSET_ATTRIBUTE);
+    scatterProgram->setAttributeBuffer(SCATTER_OFFSET_ATTRIBUTE, GL_FLOAT, 0, 4, sizeof(ScatterInstance));
+    scatterProgram->enableAttributeArray(SCATTER_YAW_ATTRIBUTE);
+    scatterProgram->setAttributeBuffer(SCATTER_YAW_ATTRIBUTE, GL_FLOAT, 4 * sizeof(GLfloat), 1, sizeof(ScatterInstance));
+    gl33->glVertexAttribDivisor(SCATTER_OFFSET_ATTRIBUTE, 1);
+    gl33->glVertexAttribDivisor(SCATTER_YAW_ATTRIBUTE, 1);
+    scatterVao.release();
+
+    // Leave the terrain state bound as initializeGL set it up
+    vao.bind();
+    vbo.bind();
+    program->bind();
+}
+
+/* Room for cells cells of two triangles in the build arena, returns where the vertices go */
+GLfloat *TerrainWindow::allocateTile(MeshTile &tile, unsigned int cells) {
+    tile.floatCount = cells * 6 * 10;
+    tile.vertices = (GLfloat *) buildArena.allocate(tile.floatCount * sizeof(GLfloat), Q_ALIGNOF(GLfloat));
+    return tile.vertices;
+}
+
+/* Writes one vertex and moves vertData past it */
+void TerrainWindow::addHeightMapVertex(GLfloat *&vertData, QVector3D &position, QVector3D &normal, QVector4D &color) {
     /* Vertex Info */
-    vertData.append(position.x());
-    vertData.append(position.y());
-    vertData.append(position.z());
+    *vertData++ = position.x();
+    *vertData++ = position.y();
+    *vertData++ = position.z();
     /* Color Info */
-    vertData.append(color.x());
-    vertData.append(color.y());
-    vertData.append(color.z());
-    vertData.append(color.w());
+    *vertData++ = color.x();
+    *vertData++ = color.y();
+    *vertData++ = color.z();
+    *vertData++ = color.w();
     /* Normal Info */
-    vertData.append(normal.x());
-    vertData.append(normal.y());
-    vertData.append(normal.z());
+    *vertData++ = normal.x();
+    *vertData++ = normal.y();
+    *vertData++ = normal.z();
 }
 
 QVector4D TerrainWindow::getColor(float height, QVector3D low, QVector3D mid, QVector3D high)  {
     float coefficient = (height - minHeight)/(maxHeight-minHeight);
     QVector3D color;
-    float lowCutoff = .5f;
-    float lowMidCutoff = .65f;
-    float midCutoff = .7f;
-    float midHighCutoff = .8f;
+    float lowCutoff = LOW_CUTOFF;
+    float lowMidCutoff = LOW_MID_CUTOFF;
+    float midCutoff = MID_CUTOFF;
+    float midHighCutoff = MID_HIGH_CUTOFF;
     if (coefficient < lowCutoff) {
         color = low;
     } else if (coefficient > lowCutoff && coefficient < lowMidCutoff) {
@@ -220,13 +751,9 @@ QVector4D TerrainWindow::getColor(float height, QVector3D low, QVector3D mid, QV
     return QVector4D(color.x(), color.y(), color.z(), 1.0f);
 }
 
-void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
-
- // unsigned char meshCount;
-
-  unsigned int meshCount;
-  unsigned int i,j;
-  float r;
+/* Seeds the corners and runs the diamond-square levels until samples stride apart exist,
+ * refineFractal continues from there */
+void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough, unsigned int stride) {
   // seed corners of array
   hmap[0][0] = a;
   hmap[meshSize-1][0] = b;
@@ -235,17 +762,36 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
   minHeight = std::min(a, std::min(b, std::min(c, std::min(d, minHeight))));
   maxHeight = std::max(a, std::max(b, std::max(c, std::max(d, maxHeight))));
 
-  // seed the RNG with time
-  srand(time(NULL));
+  // seed the RNG, with the time unless setTerrainSeed picked a seed
+  fractalRng.seed(terrainSeed);
+  fractalMeshCount = meshSize;
+  fractalRough = rough;
+
+  refineFractal(stride);
+}
+
+/* The RNG state is a member rather than rand(), so levels can be continued on another thread */
+float TerrainWindow::fractalRandom() {
+  return (fractalRng() - fractalRng.min()) / (float) (fractalRng.max() - fractalRng.min());
+}
+
+void TerrainWindow::refineFractal(unsigned int stride) {
+
+ // unsigned char meshCount;
+
+  unsigned int meshCount;
+  unsigned int i,j;
+  float r;
+  float rough = fractalRough;
 
   // iterate through meshScales until reaching floor of 1
-  for (meshCount = meshSize; meshCount > 2; meshCount = 1 + meshCount/2) {
+  for (meshCount = fractalMeshCount; meshCount > 2 && meshCount/2 >= stride; meshCount = 1 + meshCount/2) {
     rough /= 2;
 
     // diamond step
     for (i = meshCount/2; i < meshSize; i += meshCount-1) {
         for (j = meshCount/2; j < meshSize; j += meshCount-1) {
-            r = rand() / (float)RAND_MAX;
+            r = fractalRandom();
             hmap[i][j] = rough*r + 0.25f*(
                 hmap[i-meshCount/2][j-meshCount/2]
                 + hmap[i+meshCount/2][j-meshCount/2]
@@ -262,7 +808,7 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
     // even rows
     // top row
     for (j = meshCount/2; j < meshSize; j += meshCount-1) {
-        r = rand() / (float)RAND_MAX;
+        r = fractalRandom();
         hmap[0][j] = rough*r + (
             hmap[0][j-meshCount/2]
             + hmap[0][j+meshCount/2]
@@ -274,7 +820,7 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
     // middle evens
     for (i = meshCount-1; i < meshSize-(meshCount-1); i += meshCount-1) {
         for (j = meshCount/2; j < meshSize; j += meshCount-1) {
-            r = rand() / (float)RAND_MAX;
+            r = fractalRandom();
             hmap[i][j] = rough*r + 0.25f*(
                 hmap[i][j-meshCount/2]
                 + hmap[i][j+meshCount/2]
@@ -287,7 +833,7 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
     }
     // bottom row
     for (j = meshCount/2; j < meshSize; j += meshCount-1) {
-        r = rand() / (float)RAND_MAX;
+        r = fractalRandom();
         hmap[meshSize-1][j] = rough*r + (
             hmap[meshSize-1][j-meshCount/2]
             + hmap[meshSize-1][j+meshCount/2]
@@ -300,7 +846,7 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
     // odd rows
     for (i = meshCount/2; i < meshSize; i += meshCount-1) {
         // left column
-        r = rand() / (float)RAND_MAX;
+        r = fractalRandom();
         hmap[i][0] = rough*r + (
             hmap[i][meshCount/2]
             + hmap[i-meshCount/2][0]
@@ -310,7 +856,7 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
         minHeight = std::min(hmap[i][0], minHeight);
         // middle columns
         for (j = meshCount-1; j < meshSize-1; j += meshCount-1) {
-            r = rand() / (float)RAND_MAX;
+            r = fractalRandom();
             hmap[i][j] = rough*r + 0.25f*(
                 hmap[i][j-meshCount/2]
                 + hmap[i][j+meshCount/2]
@@ -321,7 +867,7 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
             minHeight = std::min(hmap[i][j], minHeight);
         }
         // right column
-        r = rand() / (float)RAND_MAX;
+        r = fractalRandom();
         hmap[i][meshSize-1] = rough*r + (
             hmap[i][(meshSize-1)-meshCount/2]
             + hmap[i-meshCount/2][meshSize-1]
@@ -332,22 +878,31 @@ void TerrainWindow::dsFractal(float a, float b, float c, float d, float rough) {
     }
 
   }
+  fractalMeshCount = meshCount;
+  fractalRough = rough;
 
   return;
 }
 
 
 void TerrainWindow::calculateNormals() {
-    unsigned int i, j;
+    allocateNormals();
+    calculateNormalRows(0, meshSize - 1);
+}
+
+/* One row of triangles per row of cells */
+void TerrainWindow::allocateNormals() {
     unsigned int meshTriangleSize = (meshSize - 1) * 2;
+    normals = buildArena.allocateRows<QVector3D>(meshSize - 1, meshTriangleSize);
+}
+
+/* Face normals of the cells in rows [begin, end) */
+void TerrainWindow::calculateNormalRows(unsigned int begin, unsigned int end) {
+    unsigned int i, j;
     QVector3D normal1, normal2, v1,v2, v3, v4;
-    normals = new QVector3D*[meshTriangleSize];
-    for (i = 0; i < meshTriangleSize; i++) {
-        normals[i] = new QVector3D[meshTriangleSize];
-    }
     float scaleFactor = ( maxCoord - minCoord ) / (float) meshSize;
 
-    for (i = 0; i < meshSize-1; i++) {
+    for (i = begin; i < end; i++) {
         for (j = 0; j < meshSize-1; j++) {
             v1 = QVector3D(minCoord + ((float) i) * scaleFactor, hmap[i][j], minCoord + ((float) j) * scaleFactor );
             v2 = QVector3D(minCoord + ((float) i) * scaleFactor, hmap[i][j+1], minCoord + ((float) j+1) * scaleFactor );
@@ -364,38 +919,72 @@ void TerrainWindow::calculateNormals() {
 
 }
 
-QVector3D *TerrainWindow::getVertexNormal(int i, int j) {
-    unsigned int u, v, w, xCoord, yCoord;
-    QVector3D *normal = new QVector3D(0.0f, 0.0f, 0.0f);
+void TerrainWindow::addHeightMap()
+{
+    std::vector<MeshTile> tiles(1);
+
+    calculateNormals();
+    addHeightMapRows(tiles[0], 0, meshSize - 1);
+    uploadTiles(tiles);
+}
+
+/* Preview mesh over the samples stride apart, flat shaded with the face normal of each triangle */
+void TerrainWindow::addCoarseHeightMap(MeshTile &tile, unsigned int stride)
+{
+    unsigned int i, j;
+    unsigned int cellsPerSide = (meshSize - 1) / stride;
+    GLfloat *vertData = allocateTile(tile, cellsPerSide * cellsPerSide);
+    QVector3D v1, v2, v3, v4, normal1, normal2;
+    QVector4D colorv1, colorv2, colorv3, colorv4;
+    QVector3D colorLow = QVector3D(0.0f, 1.0f, 0.0f);
+    QVector3D colorMid = QVector3D(0.3f, 0.3f, 0.3f);
+    QVector3D colorHigh = QVector3D(1.0f, 1.0f, 1.0f);
 
-    w = 1;
-    for (u = i-1; u < i; u++) {
-        for (v = j-1+w; v < j+w+3; v++) {
-            xCoord = std::max(0, std::min((int)meshSize * 2, (int)u));
-            yCoord = std::max(0, std::min((int)meshSize * 2, (int)v));
-            normal->operator +=(normals[xCoord][yCoord]);
+    float scaleFactor = ( maxCoord - minCoord ) / (float) meshSize;
+    for (i = 0; i + stride < meshSize; i += stride) {
+        for (j = 0; j + stride < meshSize; j += stride) {
+            v1 = QVector3D(minCoord + ((float) i) * scaleFactor, hmap[i][j], minCoord + ((float) j) * scaleFactor );
+            v2 = QVector3D(minCoord + ((float) i) * scaleFactor, hmap[i][j+stride], minCoord + ((float) j+stride) * scaleFactor );
+            v3 = QVector3D(minCoord + ((float) i+stride) * scaleFactor, hmap[i+stride][j], minCoord + ((float) j) * scaleFactor );
+            v4 = QVector3D(minCoord + ((float) i+stride) * scaleFactor, hmap[i+stride][j+stride], minCoord + ((float) j+stride) * scaleFactor );
+            colorv1 = getColor(v1.y(), colorLow, colorMid, colorHigh);
+            colorv2 = getColor(v2.y(), colorLow, colorMid, colorHigh);
+            colorv3 = getColor(v3.y(), colorLow, colorMid, colorHigh);
+            colorv4 = getColor(v4.y(), colorLow, colorMid, colorHigh);
+            normal1 = QVector3D::crossProduct(v1 - v3, v2 - v1);
+            normal1.normalize();
+            normal2 = QVector3D::crossProduct(v3 - v4, v2 - v4);
+            normal2.normalize();
+            //Triangle 1
+            addHeightMapVertex(vertData, v1, normal1, colorv1);
+            addHeightMapVertex(vertData, v2, normal1, colorv2);
+            addHeightMapVertex(vertData, v3, normal1, colorv3);
+            //Triangle 2
+            addHeightMapVertex(vertData, v3, normal2, colorv3);
+            addHeightMapVertex(vertData, v2, normal2, colorv2);
+            addHeightMapVertex(vertData, v4, normal2, colorv4);
         }
-        w++;
     }
-    normal->operator /=(6.0f);
-    return normal;
 }
 
-
-void TerrainWindow::addHeightMap(float **hmap)
+/* Appends the two triangles of every cell in rows [begin, end) */
+void TerrainWindow::addHeightMapRows(MeshTile &tile, unsigned int begin, unsigned int end)
 {
     unsigned int i, j;
-    QVector<GLfloat> vertData;
-    QVector3D v1, v2, v3, v4, *v1Normal, *v2Normal, *v3Normal, *v4Normal;
+    QVector3D v1, v2, v3, v4;
     QVector4D colorv1, colorv2, colorv3, colorv4;
+    GLfloat *vertData = allocateTile(tile, (end - begin) * (meshSize - 1));
+    QVector3D *upperNormals = buildArena.allocateArray<QVector3D>(meshSize);
+    QVector3D *lowerNormals = buildArena.allocateArray<QVector3D>(meshSize);
     QVector3D colorLow = QVector3D(0.0f, 1.0f, 0.0f);
     QVector3D colorMid = QVector3D(0.3f, 0.3f, 0.3f);
     QVector3D colorHigh = QVector3D(1.0f, 1.0f, 1.0f);
 
-    calculateNormals();
-
     float scaleFactor = ( maxCoord - minCoord ) / (float) meshSize;
-    for (i = 0; i < meshSize-1; i++) {
+    // Vertex normals of the rows above and below the current cell row
+    TerrainKernels::vertexNormalRow(normals, meshSize, begin, upperNormals);
+    for (i = begin; i < end; i++) {
+        TerrainKernels::vertexNormalRow(normals, meshSize, i + 1, lowerNormals);
         for (j = 0; j < meshSize-1; j++) {
             // Create the four vertices in the mesh
             v1 = QVector3D(minCoord + ((float) i) * scaleFactor, hmap[i][j], minCoord + ((float) j) * scaleFactor );
@@ -407,34 +996,34 @@ void TerrainWindow::addHeightMap(float **hmap)
             colorv3 = getColor(hmap[i+1][j], colorLow, colorMid, colorHigh);
             colorv4 = getColor(hmap[i+1][j+1], colorLow, colorMid, colorHigh);
 
-            v1Normal = getVertexNormal(i, j);
-            v2Normal = getVertexNormal(i, j+1);
-            v3Normal = getVertexNormal(i+1, j);
-            v4Normal = getVertexNormal(i+1, j+1);
             //Triangle 1
-            addHeightMapVertex(vertData, v1, *v1Normal, colorv1);
-            addHeightMapVertex(vertData, v2, *v2Normal, colorv2);
-            addHeightMapVertex(vertData, v3, *v3Normal, colorv3);
+            addHeightMapVertex(vertData, v1, upperNormals[j], colorv1);
+            addHeightMapVertex(vertData, v2, upperNormals[j+1], colorv2);
+            addHeightMapVertex(vertData, v3, lowerNormals[j], colorv3);
             //Triangle 2
-            addHeightMapVertex(vertData, v3, *v3Normal, colorv3);
-            addHeightMapVertex(vertData, v2, *v2Normal, colorv2);
-            addHeightMapVertex(vertData, v4, *v4Normal, colorv4);
-            delete v1Normal, v2Normal, v3Normal, v4Normal;
+            addHeightMapVertex(vertData, v3, lowerNormals[j], colorv3);
+            addHeightMapVertex(vertData, v2, upperNormals[j+1], colorv2);
+            addHeightMapVertex(vertData, v4, lowerNormals[j+1], colorv4);
         }
+        std::swap(upperNormals, lowerNormals);
     }
-    vbo.create();
-    vbo.bind();
-    vbo.allocate(vertData.constData(), vertData.count() * sizeof(GLfloat));
-
 }
 
 void TerrainWindow::paintGL()
 {
+    float alpha = advanceSimulation();
+    mvpMat = cameraMatrix(interpolateCamera(alpha));
+
     //background
     glClearColor(clearColor.redF(), clearColor.greenF(), clearColor.blueF(), clearColor.alphaF());
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 
+    vao.bind();
+    vbo.bind();
+    program->bind();
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, lightmapTexture);
     program->setUniformValue("matrix", mvpMat);
     program->setUniformValue("lightDirection", lightDirection);
     program->setUniformValue("lightIntensity", lightIntensity);
@@ -445,7 +1034,23 @@ void TerrainWindow::paintGL()
     program->enableAttributeArray(PROGRAM_NORMAL_ATTRIBUTE);
     program->setAttributeBuffer(PROGRAM_NORMAL_ATTRIBUTE, GL_FLOAT, 7 * sizeof(GLfloat), 3, 10 * sizeof(GLfloat));
 
-    glDrawArrays(GL_TRIANGLES, 0, 6 * ((meshSize-1) * (meshSize-1)));
+    glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+    renderStats.drawCalls++;
+    renderStats.triangles += vertexCount / 3;
+
+    /* All scattered objects in one instanced draw, once the full resolution terrain is in */
+    if (scatterProgram == NULL)
+        return;
+    scatterProgram->bind();
+    scatterProgram->setUniformValue("matrix", mvpMat);
+    scatterProgram->setUniformValue("lightDirection", lightDirection);
+    scatterProgram->setUniformValue("lightIntensity", lightIntensity);
+    scatterProgram->setUniformValue("color", QVector4D(0.45f, 0.4f, 0.35f, 1.0f));
+    scatterVao.bind();
+    gl33->glDrawArraysInstanced(GL_TRIANGLES, 0, 36, scatterCount);
+    renderStats.drawCalls++;
+    renderStats.triangles += 12 * (qint64) scatterCount;
+    scatterVao.release();
 
 }
 
@@ -457,53 +1062,54 @@ void TerrainWindow::resizeGL(int width, int height)
 
 /* Move the camera forward by the specified amount. Forward is relative to the direction the camera is facing */
 void TerrainWindow::moveCameraForward(float amount) {
-    int i;
-    float xMovement = -cos(PI * horizontalAngle/180.0f)*amount;
-    float zMovement = -sin(PI * horizontalAngle/180.0f)*amount;
-    position->setX(position -> x() - xMovement);
-    position->setZ(position -> z() - zMovement);
-    int xHeightMapCoord = round(((position -> x() - minCoord) * (float) meshSize)/(maxCoord-minCoord));
-    int yHeightMapCoord = round(((position -> z() - minCoord) * (float) meshSize)/(maxCoord-minCoord));
-    float deltaHeight = hmap[xHeightMapCoord][yHeightMapCoord] - position->y();
-    position->setY(hmap[xHeightMapCoord][yHeightMapCoord]);
-    mvpMat.translate(xMovement, -deltaHeight, zMovement);
-}
-
-/* Rotate view around the y-axis anchored at camera by specified number of degrees */
-void TerrainWindow::rotateCamera(float degrees, float x, float y, float z) {
-    mvpMat.translate(position->x(), position->y(), position->z()); // Translate to origin to rotate around camera
-    mvpMat.rotate(degrees, x, y, z);
-    mvpMat.translate(-position->x(), -position->y() , -position->z());
-}
-
-/* Private slot used for automove QTimer */
-void TerrainWindow::automove() {
-    moveCameraForward(.01f);
-    update();
+    float xMovement = -cos(PI * camera.horizontalAngle/180.0f)*amount;
+    float zMovement = -sin(PI * camera.horizontalAngle/180.0f)*amount;
+    QVector3D &position = camera.position;
+    if (pointCollides(QVector3D(position.x() - xMovement, position.y(), position.z() - zMovement)))
+        return;
+    position.setX(position.x() - xMovement);
+    position.setZ(position.z() - zMovement);
+    // The camera keeps its height while a progressive build is still refining the terrain
+    if (terrainReady)
+        position.setY(collisionWorld.terrainHeight(position.x(), position.z()));
 }
 
-void TerrainWindow::somersault() {
-    verticalAngle += turningSpeed;
-    if (verticalAngle > 360.0f) {
-        somersaultTimer->stop(); // Stop after one full rotation
-        verticalAngle = 0.0f;
-    }
-    rotateCamera(turningSpeed, -sin(PI * horizontalAngle/180.0f), 0.0f, cos(PI * horizontalAngle/180.0f)); //Rotate perpendicular to the camera's forward and up directions
-    update();
+/* Turn the camera by the specified number of degrees, left/right around the y-axis and up/down
+ * around its sideways axis */
+void TerrainWindow::rotateCamera(float yawDegrees, float pitchDegrees) {
+    /* Angles should never exceed 360 degrees */
+    camera.horizontalAngle = fmod(camera.horizontalAngle + yawDegrees + 360.0f, 360.0f);
+    camera.verticalAngle = fmod(camera.verticalAngle + pitchDegrees + 360.0f, 360.0f);
+}
+
+/* Turns the sun around the y-axis. The shading follows at once, the shadows once the sun term has
+ * been re-baked, which waits for the first bake to be uploaded. */
+void TerrainWindow::turnLight(float degrees) {
+    QMatrix4x4 rotation;
+    rotation.rotate(degrees, 0.0f, 1.0f, 0.0f);
+    lightDirection = rotation.mapVector(lightDirection);
+    if (lightmapSize > 1)
+        startLightBake();
 }
 
 /* Detects whether a cube represented by 2 points intersects a point */
+bool TerrainWindow::pointCollides(const QVector3D &point) {
+    std::vector<int> hits;
+    collisionWorld.queryPoint(point, hits);
+    return !hits.empty();
+}
 
 void TerrainWindow::mousePressEvent(QMouseEvent *ev) {
     if (ev->button() == Qt::LeftButton) {
-        rotateCamera(-turningSpeed, 0.0f, 1.0f, 0.0f);
-        horizontalAngle -= turningSpeed;
+        rotateCamera(-turningSpeed, 0.0f);
     } else if (ev->button() == Qt::RightButton) {
-        rotateCamera(turningSpeed, 0.0f, 1.0f, 0.0f);
-        horizontalAngle += turningSpeed;
+        rotateCamera(turningSpeed, 0.0f);
     } else {
         QWidget::mousePressEvent(ev);
     }
+    // Direct moves are shown right away rather than interpolated towards
+    if (ev->button() == Qt::LeftButton || ev->button() == Qt::RightButton)
+        previousCamera = camera;
     update();
 }
 
@@ -514,39 +1120,38 @@ void TerrainWindow::mousePressEvent(QMouseEvent *ev) {
 void TerrainWindow::keyPressEvent(QKeyEvent *ev)
 {
     if (ev->key() == Qt::Key_Left) {
-        rotateCamera(-turningSpeed, 0.0f, 1.0f, 0.0f);
-        horizontalAngle -= turningSpeed;
+        rotateCamera(-turningSpeed, 0.0f);
     } else if (ev->key() == Qt::Key_Right) {
-        rotateCamera(turningSpeed, 0.0f, 1.0f, 0.0f);
-        horizontalAngle += turningSpeed;
+        rotateCamera(turningSpeed, 0.0f);
     } else if (ev->key() == Qt::Key_Up) {
         moveCameraForward(movementSpeed);
     } else if (ev->key() == Qt::Key_Down) {
         moveCameraForward(-movementSpeed);
     } else if (ev->key() == Qt::Key_Space) {
-        // Automove every 300 ms
-        if (!automoveTimer->isActive())
-            automoveTimer->start(automoveInterval);
-        else
-            automoveTimer->stop();
+        // Automove a step every automoveInterval ms, 300 to start with
+        startAnimation();
+        automoving = !automoving;
     }
     else if (ev->key() == Qt::Key_F) {
         if (automoveInterval > 30)
             automoveInterval -= 20;
-        automoveTimer->setInterval(automoveInterval);
     } else if (ev->key() == Qt::Key_S) {
         if (automoveInterval > 30)
             automoveInterval += 20;
-        automoveTimer->setInterval(automoveInterval);
     }else if (ev->key() == Qt::Key_M) {
-        somersaultTimer->start(50);
+        startAnimation();
+        somersaulting = true;
+    } else if (ev->key() == Qt::Key_K) {
+        turnLight(-LIGHT_TURN_DEGREES);
+    } else if (ev->key() == Qt::Key_L) {
+        turnLight(LIGHT_TURN_DEGREES);
     } else {
         QWidget::keyPressEvent(ev);
     }
-    /* Angle should never exceed 360 degrees */
-    if (horizontalAngle > 360.0f) {
-        horizontalAngle -= 360.0f;
-    }
+    // Direct moves are shown right away rather than interpolated towards, the other keys leave an
+    // automove step running
+    if (ev->key() == Qt::Key_Left || ev->key() == Qt::Key_Right || ev->key() == Qt::Key_Up || ev->key() == Qt::Key_Down)
+        previousCamera = camera;
     update();
 }
 
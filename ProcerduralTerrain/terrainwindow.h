@@ -15,51 +15,130 @@ author: Zheng Xu, xuzhustc@gmail.com
 #include <QOpenGLShaderProgram>
 #include <QOpenGLBuffer>
 #include <QOpenGLTexture>
+#include <QOpenGLFunctions_3_3_Core>
 #include <QKeyEvent>
 #include <QtGui>
-#include <QTimer>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QMutex>
 #include <time.h>
+#include <random>
 
 #include <QMatrix4x4>
 #include <QVector4D>
 
+#include "buildarena.h"
+#include "collisionworld.h"
+#include "heightfield.h"
+#include "terrainkernels.h"
+#include "terrainlighting.h"
+#include "terrainscatter.h"
+#include "taskscheduler.h"
+
+/* Running totals kept by the renderer, read by TerrainBenchmark. uploadBytes counts buffer data only. */
+struct RenderStats {
+    qint64 drawCalls;
+    qint64 triangles;
+    qint64 uploadBytes;
+};
+
+/* Figures of the last terrain build and lighting bake, read by TerrainBenchmark. The arena figures
+ * are taken just before the arena is released, the resident ones once the terrain is encoded. The
+ * mesh times are only taken by the blocking build. */
+struct BuildStats {
+    qint64 firstBandTime;       // ms until the first band was meshed, the serial build meshes one band
+    qint64 meshTime;            // ms until the whole mesh was uploaded
+    size_t arenaAllocations;
+    size_t arenaBytes;
+    size_t arenaChunks;
+    size_t residentBytes;
+    float maxHeightError;
+    qint64 bakeTime;            // ms
+    int bakeRows;               // lightmap rows the bake changed
+};
+
+/* Vertex data of one band of the terrain mesh, 10 floats per vertex, held in the build arena */
+struct MeshTile {
+    GLfloat *vertices;
+    int floatCount;
+};
+
+/* Everything the view is computed from */
+struct CameraState {
+    QVector3D position;     // on the terrain, the eye is EYE_HEIGHT above it
+    float horizontalAngle;  // degrees, 90 looks along +z
+    float verticalAngle;    // degrees of somersault
+};
+
 class TerrainWindow : public QOpenGLWidget, protected QOpenGLFunctions
 {
     Q_OBJECT
+    friend class TerrainBenchmark;
 
 public:
     explicit TerrainWindow(QWidget *parent = 0);
     ~TerrainWindow();
 
+    void setPipelinedBuild(bool pipelined);
+    void setProgressiveBuild(bool progressive);
+    void setTerrainStorage(Heightfield::Mode heights, PackedNormals::Mode normals);
+    void setTerrainSeed(unsigned int seed);
+
 protected:
     void initializeGL() Q_DECL_OVERRIDE;
     void resizeGL(int w, int h) Q_DECL_OVERRIDE;
     void paintGL() Q_DECL_OVERRIDE;
 
     void initShaders();
+    void initScatter();
     void initMat();
     void keyPressEvent(QKeyEvent *) Q_DECL_OVERRIDE;
     void mousePressEvent(QMouseEvent *) Q_DECL_OVERRIDE;
 
 private:
-    void loadCubes();
-    void dsFractal(float a, float b, float c, float d, float rough);
-    void moveCube(const int cords[6][4][3], float (&nCds)[6][4][3], float x, float y, float z, float scale);
-    void addCube(QVector<GLfloat> &vertData, float coords[6][4][3], float red, float green, float blue, float alpha);
-
+    void releaseGL();
+    void dsFractal(float a, float b, float c, float d, float rough, unsigned int stride = 1);
+    void refineFractal(unsigned int stride);
+    float fractalRandom();
+
+    void generateTerrain(unsigned int stride = 1);
+    qint64 buildTerrainPipelined(const QElapsedTimer &timer, std::vector<MeshTile> &tileData, bool generate);
+    void refineTerrain();
+    void queuePublish(std::vector<MeshTile> &tiles, unsigned int stride);
+    void uploadTiles(const std::vector<MeshTile> &tiles);
+    void storeTerrain();
+    void releaseBuild();
+    void scatterObjects(CollisionWorld &world);
+    void initLightmap();
+    void bakeLighting(QVector3D direction, bool publish);
+    void startLightBake();
+    void uploadLightmap();
+    void turnLight(float degrees);
     void smoothTerrain();
+    void smoothRows(unsigned int begin, unsigned int end);
     void calculateNormals();
-    QVector3D *getVertexNormal(int i, int j);
-
-    void addHeightMap(float **hmap);
-    void addHeightMapVertex(QVector<GLfloat> &vertData, QVector3D &position, QVector3D &normal, QVector4D &color);
-    void rotateCamera(float degrees, float x, float y, float z);
+    void allocateNormals();
+    void calculateNormalRows(unsigned int begin, unsigned int end);
+
+    void addHeightMap();
+    GLfloat *allocateTile(MeshTile &tile, unsigned int cells);
+    void addHeightMapRows(MeshTile &tile, unsigned int begin, unsigned int end);
+    void addCoarseHeightMap(MeshTile &tile, unsigned int stride);
+    void addHeightMapVertex(GLfloat *&vertData, QVector3D &position, QVector3D &normal, QVector4D &color);
+    void rotateCamera(float yawDegrees, float pitchDegrees);
     void moveCameraForward(float amount);
+    QMatrix4x4 cameraMatrix(const CameraState &state);
+    CameraState interpolateCamera(float alpha);
+    float advanceSimulation();
+    void stepSimulation();
+    void startAnimation();
     QVector4D getColor(float height, QVector3D color1, QVector3D color2, QVector3D color3);
+    bool pointCollides(const QVector3D &point);
 
 
     /* Private Member variables */
     float **hmap;
+    float **rawHmap;  // heights before smoothing
     float minCoord, maxCoord;
     float minHeight, maxHeight;
     QColor clearColor;
@@ -67,39 +146,106 @@ private:
     QOpenGLVertexArrayObject vao;
     QOpenGLBuffer vbo;
     QOpenGLTexture *textures[6];
+    QOpenGLFunctions_3_3_Core *gl33;
     QString txtPath;
     unsigned int meshSize;
     QVector3D **normals;
 
+    /* Terrain build: hmap, rawHmap, normals and the mesh tiles all live in buildArena until
+     * storeTerrain has taken what it keeps and the mesh tiles are uploaded */
+    BuildArena buildArena;
+    /* All parallel work of the window: build, scatter and lighting bake. refineFuture and bakeFuture
+     * are single threads that only drive it, run() counts them as one of its threads. */
+    TaskScheduler scheduler;
+    bool pipelinedBuild;
+    QElapsedTimer buildTimer;
+    unsigned int terrainSeed;
+    std::minstd_rand fractalRng;
+    unsigned int fractalMeshCount;  // next diamond-square level to run
+    float fractalRough;
+
+    /* Resident terrain, filled in once the build has finished and the build buffers are freed */
+    Heightfield terrainHeights;
+    PackedNormals terrainNormals;
+    Heightfield::Mode heightStorage;
+    PackedNormals::Mode normalStorage;
+
+    /* Progressive build: refineTerrain hands finished meshes to publishTerrain through publishedTiles */
+    bool progressiveBuild;
+    bool terrainReady;         // full resolution hmap is in and may be read by the GUI thread
+    unsigned int meshStride;   // sample spacing of the mesh in vbo
+    int vertexCount;
+    QFuture<void> refineFuture;
+    QMutex publishLock;
+    std::vector<MeshTile> publishedTiles;
+    unsigned int publishedStride;
+    CollisionWorld publishedWorld;  // terrain and objects, filled by refineTerrain before the full resolution publish
+
     /* Collision Detection variables:
-     * cube x is represented by corners cubeMinPoints.at(x), cubeMaxPoints.at(x)*/
-    std::vector<QVector3D*> cubeMinPoints;
-    std::vector<QVector3D*> cubeMaxPoints;
-    QVector3D *position;
+     * cube x is the box with id x in collisionWorld, which also holds the terrain */
+    CollisionWorld collisionWorld;
+
+    /* Scattered objects: one shared mesh drawn once per entry of the instance buffer */
+    QOpenGLShaderProgram *scatterProgram;
+    QOpenGLVertexArrayObject scatterVao;
+    QOpenGLBuffer scatterMeshVbo;
+    QOpenGLBuffer scatterInstanceVbo;
+    int scatterCount;
+    std::vector<ScatterInstance> scatterInstances;  // from scatterObjects until initScatter uploads them
+    RenderStats renderStats;
+    BuildStats buildStats;
     QVector3D lightDirection;
     QVector3D lightIntensity;
 
+    /* Baked lighting: occlusion and sun visibility per height sample in lightmapTexture. After the
+     * first bake a light move only re-bakes the sun term on bakeFuture, publishLighting then uploads
+     * the rows that changed. */
+    TerrainLighting terrainLighting;
+    GLuint lightmapTexture;
+    unsigned int lightmapSize;  // texels a side, 1 until the first bake is uploaded
+    bool lightBaking;           // a bake has been started and not published yet
+    QFuture<void> bakeFuture;
+
 
-    /* Camera control variables */
+    /* Camera control variables: the simulation moves camera in fixed steps, frames show a blend of
+     * previousCamera and camera */
     QMatrix4x4 mvpMat;
-    QMatrix4x4 mvpMat0;
-    QTimer *automoveTimer;
-    QTimer *somersaultTimer;
+    QMatrix4x4 mvpMat0;     // projection and view of a camera at the origin
+    CameraState camera;
+    CameraState previousCamera;
+    bool automoving;
+    bool somersaulting;
     int automoveInterval;
     float turningSpeed;
     float movementSpeed;
-    float horizontalAngle;
-    float verticalAngle;
+    QElapsedTimer frameClock;
+    qint64 lastFrameTime;   // ns on frameClock
+    qint64 simulationLag;   // ns not simulated yet
 
 
 private slots:
-    void automove();
-    void somersault();
+    void nextFrame();
+    void publishTerrain();
+    void publishLighting();
 
 #define RESOURCE_FLAG true
 #define TXT_IMG_PATH "C:/Users/Zheng/Documents/openglTest/images"
-#define CUBE_NUM 6
+#define TILE_ROWS 64
+#define SMOOTH_RADIUS 2   // 5x5 box filter
+#define PREVIEW_STRIDE 16
 #define PI 3.1415926535897932384626433832795
+#define EYE_HEIGHT .01f
+#define SIMULATION_STEP_MS 10
+#define MAX_SIMULATION_STEPS 5
+#define AUTOMOVE_DISTANCE .01f
+#define SOMERSAULT_INTERVAL_MS 50.0f
+#define AMBIENT_LIGHT .3f         // share of the light that comes from the sky rather than the sun
+#define LIGHT_TURN_DEGREES 5.0f
+/* Color bands used by getColor, as fractions of the height range */
+#define LOW_CUTOFF .5f
+#define LOW_MID_CUTOFF .65f
+#define MID_CUTOFF .7f
+#define MID_HIGH_CUTOFF .8f
 };
 
 #endif  //MYWIDGET_h